@@ -0,0 +1,168 @@
+/*
+ * Benchmark of the batch prefetching (CDaemon::SetPrefetchDistance).
+ * Every message points to a node scattered in a buffer much larger than the caches, the daemon
+ * reads the whole node. The same messages are processed with several prefetch distances, the
+ * processing time and (on Linux, when perf events are available) the cache misses of the
+ * consumer thread are printed for each one.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <ThreadWrapper/Daemon.cc>
+
+/*
+ * Payload, four cache lines.
+ */
+struct alignas(64) SNode {
+  std::uint64_t aValues[32];
+};
+
+/*
+ * Cache miss counter of the calling thread, a no-op when perf events aren't available.
+ */
+class CCacheMisses {
+private:
+  int m_nFd = -1; // perf event file descriptor.
+
+public:
+  CCacheMisses() {
+#if defined(__linux__)
+    perf_event_attr Attr;
+    std::memset(&Attr, 0, sizeof(Attr));
+    Attr.type = PERF_TYPE_HARDWARE;
+    Attr.size = sizeof(Attr);
+    Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    Attr.disabled = 1;
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    m_nFd = static_cast<int>(syscall(SYS_perf_event_open, &Attr, 0, -1, -1, 0));
+    if (m_nFd >= 0) {
+      ioctl(m_nFd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(m_nFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  ~CCacheMisses() {
+#if defined(__linux__)
+    if (m_nFd >= 0)
+      close(m_nFd);
+#endif
+  }
+
+  CCacheMisses(const CCacheMisses &) = delete;
+  CCacheMisses &operator=(const CCacheMisses &) = delete;
+
+  /*
+   * Misses since the construction, -1 if they can't be counted.
+   */
+  long long Read() const {
+#if defined(__linux__)
+    long long nCount = 0;
+    if (m_nFd >= 0 && read(m_nFd, &nCount, sizeof(nCount)) == sizeof(nCount))
+      return nCount;
+#endif
+    return -1;
+  }
+};
+
+/*
+ * Daemon reading the nodes.
+ */
+class CPrefetchBench : public CDaemon<const SNode *> {
+private:
+  std::atomic<size_t> m_nProcessed = 0; // Messages processed.
+  std::uint64_t m_nSum = 0;             // Keeps the reads alive.
+  CCacheMisses *m_pMisses = nullptr;    // Counter of the consumer thread.
+  long long m_nMisses = -1;             // Misses of the run.
+
+protected:
+  void Process(int nMessageID, const SData &Data) override {
+    (void)nMessageID;
+    for (std::uint64_t nValue : Data.Data->aValues)
+      m_nSum += nValue;
+    m_nProcessed.fetch_add(1, std::memory_order_release);
+  }
+
+  void PrefetchPayload(const SData &Data) override {
+    for (size_t i = 0; i < sizeof(SNode); i += 64)
+      PrefetchRead(reinterpret_cast<const char *>(Data.Data) + i);
+  }
+
+  void ProcessThreadPreamble() override { m_pMisses = new CCacheMisses(); }
+
+  void ProcessThreadEpilogue() override {
+    m_nMisses = m_pMisses->Read();
+    delete m_pMisses;
+    CDaemon::ProcessThreadEpilogue();
+  }
+
+public:
+  size_t Processed() const { return m_nProcessed.load(std::memory_order_acquire); }
+  long long Misses() const { return m_nMisses; }
+  std::uint64_t Sum() const { return m_nSum; }
+};
+
+/*
+ * Main program
+ */
+int main() {
+  constexpr size_t kNodes = size_t(1) << 20; // 256 MiB of nodes
+  constexpr size_t kMessages = size_t(1) << 20;
+  constexpr size_t kBatch = 256;
+
+  std::vector<SNode> vNodes(kNodes);
+  for (size_t i = 0; i < kNodes; ++i)
+    std::fill(std::begin(vNodes[i].aValues), std::end(vNodes[i].aValues), i);
+
+  std::vector<size_t> vOrder(kMessages);
+  std::mt19937_64 Random(42);
+  for (size_t &nNode : vOrder)
+    nNode = Random() % kNodes;
+
+  for (size_t nDistance : {0, 2, 4, 8, 16}) {
+    CPrefetchBench objDaemon;
+    objDaemon.SetBatchSize(kBatch);
+    objDaemon.SetPrefetchDistance(nDistance);
+    objDaemon.SetClockPolicy(EClockPolicy::None);
+
+    std::vector<CPrefetchBench::SData> vData;
+    vData.reserve(kMessages);
+    for (size_t nNode : vOrder)
+      vData.emplace_back(0, 0, &vNodes[nNode]);
+    objDaemon.SafeAddMessages(vData);
+
+    auto dtStart = std::chrono::steady_clock::now();
+    objDaemon.Start();
+    while (objDaemon.Processed() < kMessages)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    auto dtEnd = std::chrono::steady_clock::now();
+    objDaemon.Stop();
+
+    double fNsPerMessage =
+        std::chrono::duration<double, std::nano>(dtEnd - dtStart).count() / kMessages;
+    std::cout << "distance " << nDistance << ": " << fNsPerMessage << " ns/message";
+    if (objDaemon.Misses() >= 0)
+      std::cout << ", " << static_cast<double>(objDaemon.Misses()) / kMessages
+                << " cache misses/message";
+    std::cout << " (checksum " << objDaemon.Sum() << ")" << std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Real time harness for CRealTimeDaemon.
+ * Once the daemon is started (and its consumer thread is running), it streams messages through
+ * it and fails if SafeAddMessage or the consumer loop call the allocator (operator new is
+ * replaced to count the calls) or block (voluntary context switches, Linux only).
+ * Exit code: 0 on success, 1 if something was allocated, 2 if a thread blocked.
+ */
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+#include <ThreadWrapper/Daemon.cc>
+
+std::atomic<bool> g_bArmed = false;     // Count the allocations?
+std::atomic<size_t> g_nAllocations = 0; // Allocations while armed.
+
+void *operator new(std::size_t nSize) {
+  if (g_bArmed.load(std::memory_order_relaxed))
+    g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(nSize > 0 ? nSize : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+// GCC can't tell operator new allocates with malloc here
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+/*
+ * Voluntary context switches of the calling thread, 0 if they can't be counted.
+ */
+long VoluntarySwitches() {
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+  rusage sUsage;
+  if (getrusage(RUSAGE_THREAD, &sUsage) == 0)
+    return sUsage.ru_nvcsw;
+#endif
+  return 0;
+}
+
+enum MSG { MSG_WARMUP, MSG_ARM, MSG_FRAME, MSG_DISARM };
+
+/*
+ * Audio frame, stored inline.
+ */
+struct SFrame {
+  std::array<float, 64> aSamples{};
+};
+
+/*
+ * Control loop stand-in.
+ */
+class CControlLoop : public CRealTimeDaemon<SFrame, 256> {
+private:
+  std::atomic<size_t> m_nProcessed = 0; // Messages processed.
+  long m_nSwitches = 0;                 // Consumer voluntary switches between arm and disarm.
+  float m_fLevel = 0.0f;                // Keeps the work alive.
+
+protected:
+  void Process(int nMessageID, const SData &Data) override {
+    switch (MSG(nMessageID)) {
+    case MSG_ARM:
+      m_nSwitches = VoluntarySwitches();
+      break;
+    case MSG_DISARM:
+      m_nSwitches = VoluntarySwitches() - m_nSwitches;
+      break;
+    case MSG_WARMUP:
+    case MSG_FRAME:
+      for (float fSample : Data.Data.aSamples)
+        m_fLevel += fSample * fSample;
+      break;
+    }
+    m_nProcessed.fetch_add(1, std::memory_order_release);
+  }
+
+public:
+  size_t Processed() const { return m_nProcessed.load(std::memory_order_acquire); }
+  long Switches() const { return m_nSwitches; }
+  float Level() const { return m_fLevel; }
+
+  /*
+   * Enqueues a message, spinning while the queue is full.
+   */
+  void Send(int nMessageID) {
+    SData Data(0, nMessageID, SFrame());
+    Data.Data.aSamples.fill(0.5f);
+    while (SafeAddMessage(std::move(Data)) == EAddResult::Rejected)
+      CpuRelax();
+  }
+
+  /*
+   * Spins until nCount messages were processed.
+   */
+  void WaitProcessed(size_t nCount) const {
+    while (Processed() < nCount)
+      std::this_thread::yield();
+  }
+};
+
+/*
+ * Main program
+ */
+int main() {
+  constexpr size_t kFrames = 100000;
+
+  CControlLoop objDaemon;
+  objDaemon.Start();
+  objDaemon.Send(MSG_WARMUP); // The consumer thread is up once it's processed
+  objDaemon.WaitProcessed(1);
+
+  long nSwitches = VoluntarySwitches();
+  g_bArmed = true;
+  objDaemon.Send(MSG_ARM);
+  for (size_t i = 0; i < kFrames; ++i)
+    objDaemon.Send(MSG_FRAME);
+  objDaemon.Send(MSG_DISARM);
+  objDaemon.WaitProcessed(kFrames + 3);
+  g_bArmed = false;
+  nSwitches = VoluntarySwitches() - nSwitches;
+  objDaemon.Stop();
+
+  std::cout << kFrames << " frames (level " << objDaemon.Level() << "): " << g_nAllocations
+            << " allocations, " << nSwitches << " producer and " << objDaemon.Switches()
+            << " consumer voluntary context switches" << std::endl;
+  if (g_nAllocations > 0)
+    return 1;
+  if (nSwitches > 0 || objDaemon.Switches() > 0)
+    return 2;
+  return 0;
+}
@@ -10,6 +10,8 @@
 
 #include <ThreadWrapper/Daemon.cc>
 
+THREADWRAPPER_ALLOCATION_HOOKS // Counts the allocations in the instrumentation build
+
 enum MSG { MSG_01, MSG_02, MSG_03 };
 
 /**************
@@ -119,5 +121,13 @@ int main() {
   // Stopping thread and joining.
   sSP.Stop();
 
+  // What the messages cost, in the instrumentation build (cmake -DENABLE_INSTRUMENT=ON)
+  if (CInstrument::kEnabled) {
+    SInstrumentCounters sCost = sSP.GetServiceStats().Instrumented();
+    std::cout << "--- " << sCost.nMessages << " messages: " << sCost.nAllocations
+              << " allocations, " << sCost.nVoluntarySwitches << " voluntary and "
+              << sCost.nInvoluntarySwitches << " involuntary context switches ---" << std::endl;
+  }
+
   return 0;
 }
@@ -0,0 +1,94 @@
+#ifndef BOUNDED_QUEUE_NS_H
+#define BOUNDED_QUEUE_NS_H
+#ifdef BOUNDED_QUEUE_NS_H
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include <ThreadWrapper/BoundedRing.cc>
+#include <ThreadWrapper/SpinLock.cc>
+#endif
+
+/*
+ * Fixed capacity FIFO queue engine for CDaemon (see HeapQueue.cc for the engine interface), for
+ * real time daemons: the messages live inline in a CBoundedRing (any number of producers and
+ * consumers, lock free), so once the daemon is constructed nothing is allocated nor locked.
+ * The priority is ignored: messages are dequeued in arrival order.
+ * TryPush fails when the ring is full and CDaemon::SafeAddMessage returns EAddResult::Rejected
+ * then (CDaemon::SafeAddMessages leaves the messages that don't fit in its vector). Push waits
+ * for room, PushBulk never does: it enqueues what fits.
+ * CBoundedQueue holds 1024 messages, SBoundedQueue<N>::CEngine holds N (a power of two).
+ * Usage: CDaemon<T, CBoundedQueue>, or CRealTimeDaemon<T, N> for the whole real time setup.
+ */
+template <class TData, class TCompare, size_t nCapacity> class CBasicBoundedQueue {
+private:
+  CBoundedRing<TData, nCapacity> m_Ring; // Messages.
+
+public:
+  /*
+   * Enqueue one object.
+   * @return false if the queue is full (Data is left untouched).
+   */
+  bool TryPush(TData &&Data) { return m_Ring.TryPush(std::move(Data)); }
+
+  /*
+   * Enqueue one object, waits for room if the queue is full.
+   */
+  void Push(TData &&Data) {
+    while (!m_Ring.TryPush(std::move(Data)))
+      CpuRelax();
+  }
+
+  /*
+   * Enqueue (move) the objects that fit and remove them from vData, the rest is left there in
+   * order. It doesn't wait for room: the objects just pushed may be the ones filling the queue.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    size_t nCount = 0;
+    while (nCount < vData.size() && m_Ring.TryPush(std::move(vData[nCount])))
+      ++nCount;
+    vData.erase(vData.begin(), vData.begin() + static_cast<std::ptrdiff_t>(nCount));
+  }
+
+  /*
+   * Dequeue the oldest object.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) { return m_Ring.TryPop(Data); }
+
+  /*
+   * Dequeue up to nMax objects.
+   * It doesn't allocate as long as vData has the capacity (CDaemon reserves its batch buffer).
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    size_t nCount = 0;
+    TData Data;
+    for (; nCount < nMax && m_Ring.TryPop(Data); ++nCount)
+      vData.push_back(std::move(Data));
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued (approximate).
+   */
+  size_t Size() const { return m_Ring.Size(); }
+
+  /*
+   * Queue capacity.
+   */
+  static constexpr size_t Capacity() { return nCapacity; }
+};
+
+/*
+ * Engine of a given capacity: CDaemon<T, SBoundedQueue<N>::template CEngine>.
+ */
+template <size_t nCapacity> struct SBoundedQueue {
+  template <class TData, class TCompare>
+  using CEngine = CBasicBoundedQueue<TData, TCompare, nCapacity>;
+};
+
+template <class TData, class TCompare>
+using CBoundedQueue = CBasicBoundedQueue<TData, TCompare, 1024>; // 1024 messages engine.
+
+#endif // BOUNDED_QUEUE_NS_H
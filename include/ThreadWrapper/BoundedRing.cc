@@ -0,0 +1,108 @@
+#ifndef BOUNDED_RING_NS_H
+#define BOUNDED_RING_NS_H
+#ifdef BOUNDED_RING_NS_H
+#include <array>
+#include <atomic>
+#include <cstddef>
+#endif
+
+/*
+ * Lock free bounded FIFO ring (Vyukov's bounded queue).
+ * Any number of producers and consumers, no allocation after construction: the objects live
+ * inline in the ring. Each cell has a sequence number telling whether it's free for the producer
+ * of that lap or filled for the consumer of that lap.
+ * nCapacity must be a power of two.
+ */
+template <class TData, size_t nCapacity> class CBoundedRing {
+  static_assert(nCapacity >= 2 && (nCapacity & (nCapacity - 1)) == 0,
+                "CBoundedRing capacity must be a power of two");
+
+private:
+  /*
+   * Ring cell.
+   */
+  struct SCell {
+    std::atomic<size_t> nSequence; // Lap marker.
+    TData Data;                    // Stored object.
+  };
+
+  std::array<SCell, nCapacity> m_aCells;   // Cells.
+  alignas(64) std::atomic<size_t> m_nTail; // Next cell to fill.
+  alignas(64) std::atomic<size_t> m_nHead; // Next cell to empty.
+
+public:
+  /*
+   * Constructor.
+   */
+  CBoundedRing() : m_nTail(0), m_nHead(0) {
+    for (size_t i = 0; i < nCapacity; ++i)
+      m_aCells[i].nSequence.store(i, std::memory_order_relaxed);
+  }
+
+  CBoundedRing(const CBoundedRing &) = delete;
+  CBoundedRing &operator=(const CBoundedRing &) = delete;
+
+  /*
+   * Enqueue one object.
+   * @return false if the ring is full (Data is left untouched).
+   */
+  bool TryPush(TData &&Data) {
+    size_t nPos = m_nTail.load(std::memory_order_relaxed);
+    for (;;) {
+      SCell &Cell = m_aCells[nPos & (nCapacity - 1)];
+      size_t nSeq = Cell.nSequence.load(std::memory_order_acquire);
+      auto nDiff = static_cast<std::ptrdiff_t>(nSeq) - static_cast<std::ptrdiff_t>(nPos);
+      if (nDiff == 0) {
+        if (m_nTail.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed)) {
+          Cell.Data = std::move(Data);
+          Cell.nSequence.store(nPos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (nDiff < 0) {
+        return false; // Full
+      } else {
+        nPos = m_nTail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /*
+   * Dequeue the oldest object.
+   * @return false if the ring is empty.
+   */
+  bool TryPop(TData &Data) {
+    size_t nPos = m_nHead.load(std::memory_order_relaxed);
+    for (;;) {
+      SCell &Cell = m_aCells[nPos & (nCapacity - 1)];
+      size_t nSeq = Cell.nSequence.load(std::memory_order_acquire);
+      auto nDiff = static_cast<std::ptrdiff_t>(nSeq) - static_cast<std::ptrdiff_t>(nPos + 1);
+      if (nDiff == 0) {
+        if (m_nHead.compare_exchange_weak(nPos, nPos + 1, std::memory_order_relaxed)) {
+          Data = std::move(Cell.Data);
+          Cell.nSequence.store(nPos + nCapacity, std::memory_order_release);
+          return true;
+        }
+      } else if (nDiff < 0) {
+        return false; // Empty
+      } else {
+        nPos = m_nHead.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /*
+   * Approximate number of queued objects.
+   */
+  size_t Size() const {
+    size_t nTail = m_nTail.load(std::memory_order_relaxed);
+    size_t nHead = m_nHead.load(std::memory_order_relaxed);
+    return nTail > nHead ? nTail - nHead : 0;
+  }
+
+  /*
+   * Ring capacity.
+   */
+  static constexpr size_t Capacity() { return nCapacity; }
+};
+
+#endif // BOUNDED_RING_NS_H
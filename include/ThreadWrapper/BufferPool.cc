@@ -0,0 +1,170 @@
+#ifndef BUFFER_POOL_NS_H
+#define BUFFER_POOL_NS_H
+#ifdef BUFFER_POOL_NS_H
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <utility>
+#endif
+
+/*
+ * Payload buffer recycling: a producer owned pool of reference counted buffers.
+ * The producer takes a buffer with Acquire, fills it and enqueues the handle as (part of) the
+ * message data, e.g. CDaemon<CBufferPool<>::CHandle>. When the last handle is destroyed (the
+ * consumer is done with the message), the buffer goes back to the pool through a lock free free
+ * list, keeping its capacity. In steady state the producer reuses the returned buffers and there
+ * is no malloc/free pair (nor cross thread free) per message.
+ * The free list is a Treiber stack: any thread pushes, only the owner pops, and it takes the whole
+ * list at once (exchange), so there is no ABA problem.
+ * Acquire must only be called by the owner thread. The pool must outlive its handles.
+ * TBuffer needs clear() and capacity(), like std::string and std::vector.
+ */
+template <class TBuffer = std::string> class CBufferPool {
+private:
+  /*
+   * Pooled buffer.
+   */
+  struct SBuffer {
+    TBuffer Buffer;               // Payload.
+    std::atomic<int> nRefs{0};    // Live handles.
+    SBuffer *pNext = nullptr;     // Next free buffer.
+    CBufferPool *pPool = nullptr; // Owner pool.
+  };
+
+  std::atomic<SBuffer *> m_pReturned{nullptr}; // Buffers returned by the handles (any thread).
+  SBuffer *m_pFree = nullptr;                  // Buffers ready for Acquire (owner thread).
+  size_t m_nMaxCapacity;                       // Bigger buffers are freed, not recycled.
+  size_t m_nAllocated = 0;                     // Buffers allocated by Acquire.
+  size_t m_nReused = 0;                        // Buffers recycled by Acquire.
+
+  /*
+   * Last handle gone: pushes the buffer to the returned list (or frees an oversized one).
+   */
+  void Return(SBuffer *pBuffer) {
+    if (pBuffer->Buffer.capacity() > m_nMaxCapacity) {
+      delete pBuffer;
+      return;
+    }
+
+    SBuffer *pHead = m_pReturned.load(std::memory_order_relaxed);
+    do {
+      pBuffer->pNext = pHead;
+    } while (!m_pReturned.compare_exchange_weak(pHead, pBuffer, std::memory_order_release,
+                                                std::memory_order_relaxed));
+  }
+
+  /*
+   * Frees a list of buffers.
+   */
+  static void FreeList(SBuffer *pBuffer) {
+    while (pBuffer != nullptr) {
+      SBuffer *pNext = pBuffer->pNext;
+      delete pBuffer;
+      pBuffer = pNext;
+    }
+  }
+
+public:
+  /*
+   * Reference counted handle to a pooled buffer, the buffer returns to its pool with the last
+   * handle. A default constructed handle is empty.
+   */
+  class CHandle {
+  private:
+    SBuffer *m_pBuffer = nullptr; // Buffer, null if empty.
+
+    friend class CBufferPool;
+    explicit CHandle(SBuffer *pBuffer) : m_pBuffer(pBuffer) {
+      m_pBuffer->nRefs.store(1, std::memory_order_relaxed);
+    }
+
+    void Release() {
+      if (m_pBuffer != nullptr && m_pBuffer->nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        m_pBuffer->pPool->Return(m_pBuffer);
+      m_pBuffer = nullptr;
+    }
+
+  public:
+    CHandle() = default;
+
+    CHandle(const CHandle &Other) : m_pBuffer(Other.m_pBuffer) {
+      if (m_pBuffer != nullptr)
+        m_pBuffer->nRefs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    CHandle(CHandle &&Other) noexcept : m_pBuffer(std::exchange(Other.m_pBuffer, nullptr)) {}
+
+    CHandle &operator=(CHandle Other) noexcept {
+      std::swap(m_pBuffer, Other.m_pBuffer);
+      return *this;
+    }
+
+    ~CHandle() { Release(); }
+
+    /*
+     * Drops this reference.
+     */
+    void Reset() { Release(); }
+
+    /*
+     * Is there a buffer?
+     */
+    explicit operator bool() const { return m_pBuffer != nullptr; }
+
+    TBuffer &operator*() { return m_pBuffer->Buffer; }
+    const TBuffer &operator*() const { return m_pBuffer->Buffer; }
+    TBuffer *operator->() { return &m_pBuffer->Buffer; }
+    const TBuffer *operator->() const { return &m_pBuffer->Buffer; }
+  };
+
+  /*
+   * Constructor.
+   * @param nMaxCapacity Buffers that grew past it are freed instead of recycled, so an occasional
+   * huge message doesn't pin its memory in the pool.
+   */
+  explicit CBufferPool(size_t nMaxCapacity = 1 << 20) : m_nMaxCapacity(nMaxCapacity) {}
+
+  CBufferPool(const CBufferPool &) = delete;
+  CBufferPool &operator=(const CBufferPool &) = delete;
+
+  /*
+   * Destructor, frees the pooled buffers (every handle must be gone).
+   */
+  ~CBufferPool() {
+    FreeList(m_pFree);
+    FreeList(m_pReturned.exchange(nullptr, std::memory_order_acquire));
+  }
+
+  /*
+   * Takes an empty buffer, a recycled one (with its capacity) when there is one.
+   * Owner thread only.
+   */
+  CHandle Acquire() {
+    if (m_pFree == nullptr)
+      m_pFree = m_pReturned.exchange(nullptr, std::memory_order_acquire);
+
+    SBuffer *pBuffer = m_pFree;
+    if (pBuffer != nullptr) {
+      m_pFree = pBuffer->pNext;
+      pBuffer->Buffer.clear();
+      ++m_nReused;
+    } else {
+      pBuffer = new SBuffer();
+      pBuffer->pPool = this;
+      ++m_nAllocated;
+    }
+    return CHandle(pBuffer);
+  }
+
+  /*
+   * How many buffers Acquire allocated (owner thread).
+   */
+  size_t Allocated() const { return m_nAllocated; }
+
+  /*
+   * How many buffers Acquire recycled (owner thread).
+   */
+  size_t Reused() const { return m_nReused; }
+};
+
+#endif // BUFFER_POOL_NS_H
@@ -0,0 +1,116 @@
+#ifndef CLOCK_NS_H
+#define CLOCK_NS_H
+#ifdef CLOCK_NS_H
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define THREADWRAPPER_HAS_TSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define THREADWRAPPER_HAS_TSC 1
+#endif
+#endif
+
+/*
+ * How the daemon timestamps its messages.
+ * The timestamps are only used to compute the enqueue -> dequeue delay (see CDaemon::GetLastDelay).
+ */
+enum class EClockPolicy {
+  None,        // No clock reads at all, the delay is never registered.
+  SteadyBatch, // One std::chrono::steady_clock read per enqueued batch and per dequeue round.
+  Tsc          // Calibrated time stamp counter, falls back to steady_clock on non x86 targets.
+};
+
+/*
+ * Time stamp counter clock.
+ * Reads the CPU time stamp counter and converts it to a steady_clock time point using a
+ * calibration taken once per process. It assumes an invariant TSC (constant rate and synchronized
+ * between cores), which is the case for any x86 CPU of the last decade.
+ */
+class CTscClock {
+private:
+  /*
+   * Calibration data, the TSC is mapped to steady_clock as dtBase + (ticks - nBaseTicks) * ratio.
+   */
+  struct SCalibration {
+    std::chrono::steady_clock::time_point dtBase; // steady_clock reference point
+    std::uint64_t nBaseTicks;                     // TSC value at dtBase
+    double fNsPerTick;                            // Nanoseconds per TSC tick
+  };
+
+  /*
+   * Raw counter read.
+   */
+  static inline std::uint64_t ReadTicks() {
+#ifdef THREADWRAPPER_HAS_TSC
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+  }
+
+  /*
+   * Measures the TSC rate against steady_clock over a short interval.
+   * It's done only once (thread safe static initialization).
+   */
+  static const SCalibration &Calibration() {
+    static const SCalibration sCalibration = [] {
+      auto dtStart = std::chrono::steady_clock::now();
+      std::uint64_t nStartTicks = ReadTicks();
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      auto dtEnd = std::chrono::steady_clock::now();
+      std::uint64_t nEndTicks = ReadTicks();
+
+      std::chrono::duration<double, std::nano> diff = dtEnd - dtStart;
+      double fNsPerTick = nEndTicks > nStartTicks ? diff.count() / double(nEndTicks - nStartTicks)
+                                                  : 1.0;
+      return SCalibration{dtEnd, nEndTicks, fNsPerTick};
+    }();
+    return sCalibration;
+  }
+
+public:
+  /*
+   * Forces the calibration, so the first Now call doesn't pay for it.
+   */
+  static void Calibrate() { (void)Calibration(); }
+
+  /*
+   * Current time, as a steady_clock time point.
+   */
+  static inline std::chrono::steady_clock::time_point Now() {
+    const SCalibration &sCal = Calibration();
+    auto nTicks = static_cast<std::int64_t>(ReadTicks() - sCal.nBaseTicks);
+    return sCal.dtBase + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double, std::nano>(nTicks * sCal.fNsPerTick));
+  }
+};
+
+/*
+ * Clock policies for CDaemon (see SDaemonPolicy).
+ * CRuntimeClock timestamps the messages as selected at runtime by CDaemon::SetClockPolicy.
+ * CNoClock compiles the timestamps out: no clock reads, no timestamp in the messages and
+ * GetLastDelay is always 0 (nor is there an observed delay for the admission control).
+ * STimestamp is the base of CDaemon::SData.
+ */
+class CRuntimeClock {
+public:
+  static constexpr bool kEnabled = true; // Are the messages timestamped?
+
+  struct STimestamp {
+    std::chrono::steady_clock::time_point
+        dtEnqueuedTime; // Message enqueue time, stamped by SafeAddMessage (see EClockPolicy)
+  };
+};
+
+class CNoClock {
+public:
+  static constexpr bool kEnabled = false; // Are the messages timestamped?
+
+  struct STimestamp {};
+};
+
+#endif // CLOCK_NS_H
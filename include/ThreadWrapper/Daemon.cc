@@ -1,37 +1,153 @@
 #ifndef DAEMON_NS_H
 #define DAEMON_NS_H
 #ifdef DAEMON_NS_H
+#include <algorithm>
 #include <atomic>
-#include <condition_variable>
+#include <climits>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <queue>
 #include <thread>
+#include <vector>
+
+#include <ThreadWrapper/BoundedQueue.cc>
+#include <ThreadWrapper/BoundedRing.cc>
+#include <ThreadWrapper/Clock.cc>
+#include <ThreadWrapper/HeapQueue.cc>
+#include <ThreadWrapper/Scheduler.cc>
+#include <ThreadWrapper/ServiceStats.cc>
+#include <ThreadWrapper/SpinLock.cc>
+#include <ThreadWrapper/StopToken.cc>
+#include <ThreadWrapper/ThreadPool.cc>
+#include <ThreadWrapper/Wait.cc>
+#include <ThreadWrapper/Watchdog.cc>
 #endif
 
+/*
+ * How Stop handles the messages that are still queued.
+ */
+enum class EStopMode {
+  DrainAll,           // Process everything (default).
+  DrainUntilDeadline, // Process until the deadline, then hand the leftovers back to the caller.
+  Abort               // Process nothing else, the leftovers are discarded.
+};
+
+/*
+ * What SafeAddMessage did with the message.
+ */
+enum class EAddResult {
+  Accepted, // Enqueued.
+  Rejected  // Not enqueued: its queueing delay would exceed the latency SLO, or the queue is full.
+};
+
+/*
+ * Compile time policies of CDaemon (the queue engine, and its locking policy, is the second
+ * CDaemon parameter, e.g. CHeapQueue or CSpinHeapQueue).
+ * - TWait: how the consumer threads wait for work, CConditionWait (default) or CSpinWait;
+ * - TClock: message timestamps, CRuntimeClock (default, see CDaemon::SetClockPolicy) or CNoClock;
+ * - TStats: service statistics, CServiceStats (default, see CDaemon::SetServiceStats) or CNoStats.
+ * Only what these policies cover is compiled out: CNoClock removes the clock reads and message
+ * timestamps, CNoStats the statistics bookkeeping, CSpinWait the producer side locking, e.g.
+ * CDaemon<T, CSpinDoubleBufferQueue, SDaemonPolicy<CSpinWait, CNoClock, CNoStats>> is a FIFO
+ * daemon with no timestamps, no statistics and no other lock than the queue spin lock.
+ * The other features (express lane, retries, watchdog, ticks, scheduler tasks, the pre/after
+ * queue hooks) are always built in: when unused they cost a few relaxed loads and branches per
+ * message, and their SData and CDaemon members.
+ */
+template <class TWait = CConditionWait, class TClock = CRuntimeClock, class TStats = CServiceStats>
+struct SDaemonPolicy {
+  using CWait = TWait;   // Wait policy (Wait.cc).
+  using CClock = TClock; // Clock policy (Clock.cc).
+  using CStats = TStats; // Stats policy (ServiceStats.cc).
+};
+
 /*
  * Daemon class.
  * This is a wrapper for the std::thread object.
  * Specialize this class (check out SimplePrint.cc) and then override the process function.
+ * TQueue is the queue engine, check out HeapQueue.cc for the default one and the engine interface.
+ * TPolicy holds the other compile time policies, see SDaemonPolicy.
  */
-template <class T> class CDaemon {
+template <class T, template <class, class> class TQueue = CHeapQueue,
+          class TPolicy = SDaemonPolicy<>>
+class CDaemon {
 public:
+  /*
+   * Message ID of the scheduler work (see GetScheduler), so it never shares a message ID with the
+   * messages: CWeightedFairQueue gives it its own sub-queue (and share) and OnStall reports it
+   * with this ID. Scheduler work doesn't count in the service statistics.
+   */
+  static constexpr int kTaskMessageID = INT_MIN;
+
   /*
    * Data struct to hold the data and the info about on how to process this data (using nMessageID).
    */
-  struct SData {
-    int nPriority;  // Message priority
-    int nMessageID; // Message id
-    T Data;         // Message data
-    std::chrono::time_point<std::chrono::high_resolution_clock> dtEnqueuedTime =
-        std::chrono::high_resolution_clock::now(); // Message enqueue time
+  struct SData : public TPolicy::CClock::STimestamp {
+    int nPriority;                   // Message priority
+    int nMessageID;                  // Message id
+    T Data;                          // Message data
+    int nProducerID = 0;             // Producer id (see CFairQueue)
+    CScheduledTask *pTask = nullptr; // Scheduler work, run instead of Process (see GetScheduler)
 
-    SData(int p_nPriority, int p_nMessageID, T p_Data)
-        : nPriority(p_nPriority), nMessageID(p_nMessageID), Data(p_Data) {}
+    SData(int p_nPriority, int p_nMessageID, T p_Data, int p_nProducerID = 0)
+        : nPriority(p_nPriority), nMessageID(p_nMessageID), Data(std::move(p_Data)),
+          nProducerID(p_nProducerID) {}
 
     SData() = default;
   };
 
+  /*
+   * What Stop did with the queued messages.
+   */
+  struct SStopReport {
+    size_t nProcessed = 0;         // Messages processed while stopping.
+    size_t nDiscarded = 0;         // Messages left unprocessed.
+    std::vector<SData> vLeftovers; // The unprocessed messages (EStopMode::DrainUntilDeadline).
+  };
+
+  /*
+   * Message that failed every attempt allowed by the retry policy (see SetRetryPolicy).
+   */
+  struct SDeadLetter {
+    SData Data;                // The message.
+    int nAttempts = 0;         // How many times Process was called for it.
+    std::exception_ptr pError; // What the last attempt threw.
+  };
+
+  /*
+   * Time budget given to OnIdle.
+   * Idle work must check ShouldYield often and return as soon as it's true.
+   */
+  class CIdleBudget {
+  private:
+    const CDaemon &m_Daemon;                            // Daemon running the idle work.
+    std::chrono::steady_clock::time_point m_dtDeadline; // End of the budget.
+
+  public:
+    CIdleBudget(const CDaemon &Daemon, std::chrono::steady_clock::time_point dtDeadline)
+        : m_Daemon(Daemon), m_dtDeadline(dtDeadline) {}
+
+    /*
+     * Should the idle work stop?
+     * True when a message arrived, when the daemon is stopping or sleeping, or when the budget
+     * ran out.
+     */
+    bool ShouldYield() const {
+      return m_Daemon.HasWork() || std::chrono::steady_clock::now() >= m_dtDeadline;
+    }
+
+    /*
+     * End of the budget.
+     */
+    std::chrono::steady_clock::time_point Deadline() const { return m_dtDeadline; }
+  };
+
 private:
   /*
    * Private class that provide the comparison function.
@@ -40,40 +156,528 @@ private:
   class CPriorityQueueComparison {
   public:
     CPriorityQueueComparison() {}
-    bool operator()(const SData &lData, const SData &rData) {
+    bool operator()(const SData &lData, const SData &rData) const {
       return lData.nPriority > rData.nPriority;
     }
   };
 
+  /*
+   * Message waiting for its next attempt.
+   */
+  struct SRetry {
+    std::chrono::steady_clock::time_point dtDue; // When to try again.
+    int nAttempt;                                // Attempt number of the next try.
+    SData Data;                                  // The message.
+
+    bool operator>(const SRetry &Other) const { return dtDue > Other.dtDue; }
+  };
+
+public:
+  using CQueue = TQueue<SData, CPriorityQueueComparison>; // Queue engine type.
+  using CStats = typename TPolicy::CStats;                // Service statistics type.
+
 private:
-  std::thread m_Thread; // Thread object.
-  std::priority_queue<SData, std::vector<SData>, CPriorityQueueComparison>
-      m_Queue;                             // Thread processing queue.
+  std::vector<std::thread> m_vThreads;     // Thread objects, one per consumer.
+  std::vector<std::future<void>> m_vPooled; // Consumers running in pool threads.
+  bool m_bPooledThreads = false;           // Run the consumers in CThreadPool::Shared()?
+  int m_nConsumerThreads = 1;              // How many threads consume the queue.
+  size_t m_nBatchSize = 1;                 // How many messages are dequeued per round.
+  size_t m_nPrefetchDistance = 0;          // Batch messages prefetched ahead of Process.
+  CQueue m_Queue;                          // Thread processing queue.
+  CBoundedRing<SData, 32> m_Express;       // Express lane, served before m_Queue.
+  std::atomic<long> m_nExpress = 0;        // Messages in the express lane.
+  std::atomic<long> m_nQueued = 0;         // Queued messages (may be -1 while a push lands).
+  std::atomic<int> m_nActive = 0;          // Threads that didn't finish the epilogue yet.
   std::atomic<bool> m_bIsRunning = false;  // Is this thread running?
   std::atomic<bool> m_bFinished = false;   // Did this thread finish the processing?
   std::atomic<int> m_nSleepMs = 0;         // How long this thread should sleep?
   std::atomic<bool> m_bIsSleeping = false; // Is this thread sleeping?
-  std::atomic<double> m_fDelaySec; // How long took for the last message to be processed? In seconds
-  std::condition_variable m_ConditionVar; // Conditional variable to notify the thread object when
-                                          // there is something to process.
-  mutable std::mutex m_Mutex;             // Mutex.
+  std::atomic<double> m_fDelaySec = 0; // How long took for the last message to be processed? (s)
+  EClockPolicy m_eClockPolicy = EClockPolicy::SteadyBatch; // How the messages are timestamped.
+  EStopMode m_eStopMode = EStopMode::DrainAll;             // Current Stop mode.
+  std::chrono::steady_clock::time_point m_dtStopDeadline;  // Current Stop deadline.
+  std::atomic<size_t> m_nStopProcessed = 0;                // Processed while stopping.
+  int m_nDrainHelpers = 0;                                 // Extra threads draining on Stop.
+  size_t m_nDrainChunk = 256;                              // Messages per parallel drain chunk.
+  std::atomic<bool> m_bDrainStarted = false;               // Drain helpers already spawned?
+  std::chrono::milliseconds m_IdleInterval{0};             // Idle time before calling OnIdle.
+  std::chrono::microseconds m_IdleBudget{0};               // Budget given to OnIdle.
+  std::chrono::microseconds m_TickPeriod{0};               // OnTick period.
+  std::atomic<std::chrono::steady_clock::rep> m_nNextTick = 0; // Next OnTick (steady_clock).
+  bool m_bServiceStats = false;                                // Keep the service statistics?
+  std::chrono::microseconds m_LatencySLO{0};                   // Admission control SLO.
+  std::chrono::milliseconds m_StallThreshold{0};               // Watchdog threshold.
+  std::unique_ptr<CWatchdog::SSlot[]> m_pWatchSlots;           // One per processing thread.
+  std::atomic<size_t> m_nWatchSlot = 0;                        // Next slot to hand out.
+  CWatchdog::SProbe m_WatchProbe;                              // Registration in the watchdog.
+  bool m_bWatched = false;                                     // Is m_WatchProbe registered?
+  CStats m_Stats;                                              // Service statistics.
+  int m_nMaxAttempts = 0;                                      // Retry policy, 0 disables it.
+  std::chrono::milliseconds m_InitialBackoff{0};               // Delay before the first retry.
+  std::chrono::milliseconds m_MaxBackoff{0};                   // Delay cap.
+  size_t m_nDeadLetterCapacity = 0;                            // Dead letter queue bound.
+  std::vector<SRetry> m_vRetries;                              // Timed queue, min heap by dtDue.
+  std::atomic<long> m_nRetries = 0;                            // Messages in m_vRetries.
+  std::atomic<std::chrono::steady_clock::rep> m_nRetryDue = 0; // Earliest dtDue (steady_clock).
+  std::deque<SDeadLetter> m_DeadLetters;                       // Dead letter queue.
+  size_t m_nDroppedDeadLetters = 0;                            // Dropped, the queue was full.
+  mutable std::mutex m_RetryMutex; // Protects m_vRetries and the dead letter queue.
+  std::vector<SData> m_vCutOff;      // Batch tails cut off by Stop (see SetAsideRest).
+  std::mutex m_CutOffMutex;          // Protects m_vCutOff.
+  CStopSource m_StopSource;          // Cooperative cancellation of the current run.
+  CStopToken m_StopToken;            // m_StopSource token, for Process and the hooks.
+  std::promise<void> m_AllDone;      // Set when every consumer finished the epilogue.
+  std::future<void> m_AllDoneFuture; // m_AllDone future.
+  typename TPolicy::CWait m_Wait;    // Wait policy, wakes the threads up when there's work.
+
+  static constexpr bool kClock = TPolicy::CClock::kEnabled;            // Timestamped messages?
+  static constexpr bool kStats = CStats::kEnabled;                     // Service statistics?
+  static constexpr bool kInstrument = kStats && CInstrument::kEnabled; // Instrumentation build?
+
+  // Watchdog slot of the calling thread, null when it isn't watched.
+  static inline thread_local CWatchdog::SSlot *tl_pWatchSlot = nullptr;
+
+  /*
+   * Wakes a thread up after something was enqueued.
+   * The queue engine has its own synchronization, the wait policy only has to wake a waiting
+   * thread (CConditionWait only takes its mutex when a thread is waiting).
+   */
+  inline void WakeUp() { m_Wait.NotifyOne(); }
+
+  /*
+   * Wakes the threads up after nCount messages were enqueued at once: every waiting thread when
+   * there's work for more than one, so a bulk enqueue doesn't leave all but one consumer asleep.
+   */
+  inline void WakeUp(size_t nCount) {
+    if (nCount > 1 && m_nConsumerThreads > 1)
+      m_Wait.NotifyAll();
+    else
+      m_Wait.NotifyOne();
+  }
+
+  /*
+   * Are the messages timestamped? False at compile time with CNoClock.
+   */
+  inline bool Timestamped() const {
+    if constexpr (kClock)
+      return m_eClockPolicy != EClockPolicy::None;
+    else
+      return false;
+  }
+
+  /*
+   * Are the service statistics kept? False at compile time with CNoStats.
+   */
+  inline bool ServiceStats() const {
+    if constexpr (kStats)
+      return m_bServiceStats;
+    else
+      return false;
+  }
+
+  /*
+   * Stamps the enqueue time (nothing with CNoClock).
+   */
+  inline void Stamp(SData &Data, std::chrono::steady_clock::time_point dtNow) {
+    if constexpr (kClock)
+      Data.dtEnqueuedTime = dtNow;
+    else
+      (void)Data, (void)dtNow;
+  }
+
+  /*
+   * Prefetches a batch message and, through PrefetchPayload, what it points to.
+   */
+  inline void Prefetch(const SData &Data) {
+    PrefetchRead(&Data);
+    PrefetchPayload(Data);
+  }
+
+  /*
+   * Calls Process for a dequeued message, or runs it if it's scheduler work.
+   * The instrumentation build measures its allocator calls and context switches.
+   */
+  inline void Invoke(const SData &Data) {
+    SInstrumentCounters sBefore;
+    if constexpr (kInstrument)
+      sBefore = CInstrument::Thread();
+
+    if (Data.pTask != nullptr)
+      Data.pTask->Run();
+    else
+      Process(Data.nMessageID, Data);
+
+    if constexpr (kInstrument)
+      m_Stats.OnInstrumented(CInstrument::Thread() - sBefore);
+  }
+
+  /*
+   * Calls Process for a dequeued message.
+   * The service time goes to the service statistics and to the queue engine when it wants it
+   * (OnServiced), and the watchdog sees the message while it's processed.
+   */
+  inline void ProcessTimed(const SData &Data) {
+    constexpr bool bEngineTimed = SQueueHasOnServiced<CQueue, SData>::value;
+    CWatchdog::SSlot *pWatchSlot = tl_pWatchSlot;
+    if (!bEngineTimed && !ServiceStats() && pWatchSlot == nullptr) {
+      Invoke(Data);
+      return;
+    }
+
+    auto dtStart = std::chrono::steady_clock::now();
+    if (pWatchSlot != nullptr)
+      pWatchSlot->Begin(Data.nMessageID, dtStart);
+    Invoke(Data);
+    if (pWatchSlot != nullptr)
+      pWatchSlot->End();
+    auto dtEnd = std::chrono::steady_clock::now();
+    if constexpr (bEngineTimed)
+      m_Queue.OnServiced(Data, dtEnd - dtStart);
+    if (ServiceStats() && Data.pTask == nullptr)
+      m_Stats.OnServiced(Data.nPriority, dtEnd - dtStart, dtEnd);
+  }
+
+  /*
+   * Calls Process for a dequeued message, with the retry policy when there is one.
+   * @param nAttempt Attempt number (1 unless it's a retry).
+   */
+  inline void Dispatch(const SData &Data, int nAttempt = 1) {
+    if (m_nMaxAttempts == 0) {
+      ProcessTimed(Data); // Exceptions escape, as usual
+      return;
+    }
+
+    try {
+      ProcessTimed(Data);
+    } catch (...) {
+      if (tl_pWatchSlot != nullptr)
+        tl_pWatchSlot->End();
+      ScheduleRetry(Data, nAttempt, std::current_exception());
+    }
+  }
+
+  /*
+   * Schedules the next attempt of a failed message, with exponential backoff, or moves it to the
+   * dead letter queue when it ran out of attempts.
+   * @param nAttempt Attempt that failed.
+   * @param pError What it threw.
+   */
+  void ScheduleRetry(const SData &Data, int nAttempt, std::exception_ptr pError) {
+    std::scoped_lock<std::mutex> lock(m_RetryMutex);
+    if (nAttempt >= m_nMaxAttempts) {
+      if (m_nDeadLetterCapacity == 0) {
+        ++m_nDroppedDeadLetters;
+        return;
+      }
+      if (m_DeadLetters.size() >= m_nDeadLetterCapacity) {
+        m_DeadLetters.pop_front(); // Keep the most recent ones
+        ++m_nDroppedDeadLetters;
+      }
+      m_DeadLetters.push_back(SDeadLetter{Data, nAttempt, std::move(pError)});
+      return;
+    }
+
+    auto Backoff = m_InitialBackoff * (1LL << std::min(nAttempt - 1, 30));
+    Backoff = std::min<decltype(Backoff)>(Backoff, m_MaxBackoff);
+    m_vRetries.push_back(
+        SRetry{std::chrono::steady_clock::now() + Backoff, nAttempt + 1, Data});
+    std::push_heap(m_vRetries.begin(), m_vRetries.end(), std::greater<SRetry>());
+    m_nRetryDue = m_vRetries.front().dtDue.time_since_epoch().count();
+    ++m_nRetries;
+  }
+
+  /*
+   * Takes the next retry if it's due.
+   * @param bIgnoreDue Take it even if it isn't due yet.
+   * @return false if there is none.
+   */
+  bool TakeRetry(SRetry &Retry, bool bIgnoreDue) {
+    if (m_nRetries.load(std::memory_order_relaxed) <= 0)
+      return false;
+
+    std::scoped_lock<std::mutex> lock(m_RetryMutex);
+    if (m_vRetries.empty() ||
+        (!bIgnoreDue && m_vRetries.front().dtDue > std::chrono::steady_clock::now()))
+      return false;
+
+    std::pop_heap(m_vRetries.begin(), m_vRetries.end(), std::greater<SRetry>());
+    Retry = std::move(m_vRetries.back());
+    m_vRetries.pop_back();
+    if (!m_vRetries.empty())
+      m_nRetryDue = m_vRetries.front().dtDue.time_since_epoch().count();
+    --m_nRetries;
+    return true;
+  }
+
+  /*
+   * Processes the retries that are due.
+   * @return how many messages were processed.
+   */
+  size_t ProcessRetries() {
+    size_t nCount = 0;
+    SRetry Retry;
+    while (TakeRetry(Retry, false)) {
+      Dispatch(Retry.Data, Retry.nAttempt);
+      ++nCount;
+    }
+    return nCount;
+  }
+
+  /*
+   * Is a retry due?
+   */
+  inline bool RetryDue() const {
+    return m_nRetries.load() > 0 &&
+           std::chrono::steady_clock::now().time_since_epoch().count() >= m_nRetryDue.load();
+  }
+
+  /*
+   * Processes everything in the express lane.
+   * @return how many messages were processed.
+   */
+  size_t ProcessExpress() {
+    size_t nCount = 0;
+    SData Data;
+    while (TryDequeueExpress(Data)) {
+      if (Timestamped())
+        RegisterDelayToProcess(Data, Now());
+      Dispatch(Data);
+      ++nCount;
+    }
+    return nCount;
+  }
+
+  /*
+   * Should the remaining messages be left unprocessed?
+   * Only true while stopping with EStopMode::Abort, or past the EStopMode::DrainUntilDeadline
+   * deadline.
+   */
+  inline bool StopCutoff() const {
+    if (m_bIsRunning.load(std::memory_order_acquire) || m_eStopMode == EStopMode::DrainAll)
+      return false;
+    return m_eStopMode == EStopMode::Abort || std::chrono::steady_clock::now() >= m_dtStopDeadline;
+  }
+
+  /*
+   * Is there something for the thread loop to do?
+   * a) Queue (or express lane) is not empty;
+   * b) We called stop (to exit the loop);
+   * c) The sleep function was called;
+   * d) A retry is due.
+   */
+  inline bool HasWork() const {
+    return m_nQueued.load() > 0 || m_nExpress.load() > 0 || !m_bIsRunning.load() ||
+           m_nSleepMs.load() > 0 || RetryDue();
+  }
+
+  /*
+   * Calls OnTick if the next tick is due.
+   * The schedule is drift free: ticks stay on the Start + k * period grid, missed ticks are
+   * skipped (not replayed). With several consumer threads only one of them runs each tick.
+   */
+  void TickIfDue(std::chrono::steady_clock::time_point dtNow) {
+    auto nNow = dtNow.time_since_epoch().count();
+    auto nNext = m_nNextTick.load();
+    if (nNow < nNext)
+      return;
+
+    auto nPeriod = std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_TickPeriod)
+                       .count();
+    auto nFollowing = nNext + ((nNow - nNext) / nPeriod + 1) * nPeriod;
+    if (m_nNextTick.compare_exchange_strong(nNext, nFollowing))
+      OnTick(dtNow);
+  }
+
+  /*
+   * We wait in this context until there is something to process.
+   * With a tick period or an idle interval, the wait times out to call OnTick or OnIdle, and with
+   * pending retries it times out when the next one is due.
+   * @param dtIdleSince When this thread became idle, time_point::min() if it just processed
+   * something (only used with an idle interval).
+   * @return false if the wait timed out, nothing to process.
+   */
+  bool WaitForWork(std::chrono::steady_clock::time_point &dtIdleSince) {
+    using Clock = std::chrono::steady_clock;
+    bool bIdleHook = m_IdleInterval.count() > 0;
+    bool bTick = m_TickPeriod.count() > 0;
+    bool bRetry = m_nRetries.load() > 0;
+    if (bIdleHook && dtIdleSince == Clock::time_point::min())
+      dtIdleSince = Clock::now();
+
+    auto dtWake = bIdleHook ? dtIdleSince + m_IdleInterval : Clock::time_point::max();
+    if (bTick)
+      dtWake = std::min(dtWake, Clock::time_point(Clock::duration(m_nNextTick.load())));
+    if (bRetry)
+      dtWake = std::min(dtWake, Clock::time_point(Clock::duration(m_nRetryDue.load())));
+    bool bHasWork = m_Wait.WaitUntil(dtWake, [&] { return HasWork(); });
+
+    if (!bHasWork) {
+      auto dtNow = Clock::now();
+      if (bTick)
+        TickIfDue(dtNow);
+      if (bIdleHook && dtNow >= dtIdleSince + m_IdleInterval) {
+        OnIdle(CIdleBudget(*this, dtNow + m_IdleBudget));
+        dtIdleSince = Clock::now(); // Next call after another interval
+      }
+    }
+    return bHasWork;
+  }
+
+  /*
+   * Sets the messages from vBatch[nFirst] on aside, so Stop hands them back ahead of the queue.
+   * They aren't pushed back to the queue: a FIFO engine would put them behind newer messages (and
+   * a bounded one may be full). Only called once the Stop mode cut the processing off.
+   */
+  void SetAsideRest(std::vector<SData> &vBatch, size_t nFirst) {
+    std::scoped_lock<std::mutex> lock(m_CutOffMutex);
+    std::move(vBatch.begin() + nFirst, vBatch.end(), std::back_inserter(m_vCutOff));
+  }
+
+  /*
+   * Parallel drain worker.
+   * Takes the backlog in priority ordered chunks until it's empty (or the Stop mode cuts it off).
+   */
+  void DrainChunks() {
+    bool bOwnSlot = m_bWatched && tl_pWatchSlot == nullptr; // Helper thread
+    if (bOwnSlot)
+      tl_pWatchSlot = AcquireWatchSlot();
+
+    std::vector<SData> vChunk;
+    vChunk.reserve(m_nDrainChunk);
+    while (!StopCutoff() && TryDequeueBatch(vChunk, m_nDrainChunk)) {
+      for (size_t i = 0; i < vChunk.size(); ++i) {
+        if (StopCutoff()) {
+          SetAsideRest(vChunk, i);
+          break;
+        }
+        Dispatch(vChunk[i]);
+        ++m_nStopProcessed;
+      }
+      vChunk.clear();
+    }
+
+    if (bOwnSlot)
+      tl_pWatchSlot = nullptr;
+  }
+
+  /*
+   * Stop time retry processing: waits for the pending retries to be due and processes them
+   * (and the retries they cause), as far as the Stop mode allows it. It doesn't sleep past the
+   * EStopMode::DrainUntilDeadline deadline: the retries still pending then are Stop leftovers.
+   */
+  void DrainRetries() {
+    SRetry Retry;
+    while (!StopCutoff() && TakeRetry(Retry, true)) {
+      auto dtWake = Retry.dtDue;
+      if (m_eStopMode == EStopMode::DrainUntilDeadline)
+        dtWake = std::min(dtWake, m_dtStopDeadline);
+      std::this_thread::sleep_until(dtWake);
+      if (StopCutoff()) {
+        std::scoped_lock<std::mutex> lock(m_RetryMutex); // Give it back, so Stop accounts for it
+        m_vRetries.push_back(std::move(Retry));
+        std::push_heap(m_vRetries.begin(), m_vRetries.end(), std::greater<SRetry>());
+        m_nRetryDue = m_vRetries.front().dtDue.time_since_epoch().count();
+        ++m_nRetries;
+        break;
+      }
+      Dispatch(Retry.Data, Retry.nAttempt);
+      ++m_nStopProcessed;
+    }
+  }
+
+  /*
+   * Hands a watchdog slot to the calling thread.
+   * @return null if every slot is taken (the thread isn't watched rather than sharing a slot).
+   */
+  CWatchdog::SSlot *AcquireWatchSlot() {
+    size_t nSlot = m_nWatchSlot++;
+    return nSlot < m_WatchProbe.nSlots ? &m_pWatchSlots[nSlot] : nullptr;
+  }
+
+  /*
+   * Registers the daemon in the shared watchdog, with one slot per consumer and drain helper.
+   */
+  void Watch() {
+    m_WatchProbe.nSlots = static_cast<size_t>(m_nConsumerThreads + m_nDrainHelpers);
+    m_pWatchSlots = std::make_unique<CWatchdog::SSlot[]>(m_WatchProbe.nSlots);
+    m_nWatchSlot = 0;
+    m_WatchProbe.pSlots = m_pWatchSlots.get();
+    m_WatchProbe.Threshold = m_StallThreshold;
+    m_WatchProbe.Stall = [this](int nMessageID, std::chrono::nanoseconds Elapsed) {
+      OnStall(nMessageID, Elapsed);
+    };
+    CWatchdog::Shared().Watch(&m_WatchProbe);
+    m_bWatched = true;
+  }
+
+  /*
+   * Joins all the consumer threads.
+   */
+  void Join() {
+    for (std::thread &Thread : m_vThreads)
+      if (Thread.joinable())
+        Thread.join();
+    m_vThreads.clear();
+
+    std::vector<std::future<void>> vPooled;
+    vPooled.swap(m_vPooled);
+    for (std::future<void> &Pooled : vPooled)
+      Pooled.get(); // Rethrows what escaped the thread, like an unhandled exception would
+
+    if (m_bWatched) {
+      CWatchdog::Shared().Unwatch(&m_WatchProbe);
+      m_bWatched = false;
+    }
+  }
+
+  /*
+   * Reads the clock selected by the clock policy.
+   * Shouldn't be called with EClockPolicy::None.
+   */
+  inline std::chrono::steady_clock::time_point Now() const {
+    if (m_eClockPolicy == EClockPolicy::Tsc)
+      return CTscClock::Now();
+    return std::chrono::steady_clock::now();
+  }
 
   /*
    * Registers the delay between enqueueing the message and the time to start processing it.
    * The delay is available at GetLastDelay
+   * @param dtNow Time of the current dequeue round.
    * @see GetLastDelay
    */
-  inline void RegisterDelayToProcess(const SData &Data) {
-    // Calculate
-    auto dtNow = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> diff = dtNow - Data.dtEnqueuedTime;
-    // Register
-    m_fDelaySec.store(diff.count());
+  inline void RegisterDelayToProcess(const SData &Data,
+                                     std::chrono::steady_clock::time_point dtNow) {
+    if constexpr (kClock) {
+      std::chrono::duration<double> diff = dtNow - Data.dtEnqueuedTime;
+      m_fDelaySec.store(diff.count());
+      if (ServiceStats())
+        m_Stats.OnDelay(Data.nPriority, diff.count());
+    } else {
+      (void)Data, (void)dtNow;
+    }
+  }
+
+  /*
+   * Admission control, should a message of this priority be enqueued?
+   * It's rejected when the expected wait exceeds the SLO, or when the delay observed for its
+   * priority exceeds it while there's still work ahead of it (so an idle daemon accepts again).
+   */
+  bool Admit(int nPriority) {
+    double fSLOSec = std::chrono::duration<double>(m_LatencySLO).count();
+    double fExpectedSec = m_Stats.ExpectedWait(nPriority, m_nConsumerThreads);
+    if (fExpectedSec > fSLOSec ||
+        (fExpectedSec > 0.0 && m_Stats.ObservedDelay(nPriority) > fSLOSec)) {
+      m_Stats.OnRejected(nPriority);
+      return false;
+    }
+    return true;
   }
 
 protected:
   /*
    * Last message dequeue delay in seconds.
+   * Always 0 with EClockPolicy::None.
    */
   inline double GetLastDelay() const { return m_fDelaySec.load(); }
 
@@ -88,24 +692,62 @@ protected:
    */
   inline void SleepNow(int nMs) { std::this_thread::sleep_for(std::chrono::milliseconds(nMs)); }
 
+  /*
+   * Stop token of the current run, for Process and the other hooks.
+   * The stop is requested when the remaining work isn't wanted anymore: right away by
+   * Stop(EStopMode::Abort), at the deadline by Stop(EStopMode::DrainUntilDeadline) if the threads
+   * are still busy, and when the run is over otherwise (EStopMode::DrainAll still processes
+   * everything). Long handlers should check stop_requested() or register a CStopCallback to
+   * interrupt a blocking call (see StopToken.cc).
+   * @see Stop
+   */
+  inline const CStopToken &GetStopToken() const { return m_StopToken; }
+
   /*
    * Safely dequeue a Data object so we can process it.
    * @param reference to a variable, it'll receive the top item of the queue.
    * @return true if there is data.
    */
   bool TryDequeue(SData &Data) {
-    bool bRtn = false;
-    std::scoped_lock<std::mutex> lock(m_Mutex);
-
-    if (!m_Queue.empty()) {
-      Data = m_Queue.top();
-      m_Queue.pop();
-      bRtn = true;
+    bool bRtn = m_Queue.TryPop(Data);
+    if (bRtn) {
+      --m_nQueued;
+      if (ServiceStats())
+        m_Stats.OnDeparture(Data.nPriority);
     }
 
     return bRtn;
   }
 
+  /*
+   * Safely dequeue a Data object from the express lane.
+   * @param reference to a variable, it'll receive the oldest express message.
+   * @return true if there is data.
+   */
+  bool TryDequeueExpress(SData &Data) {
+    if (m_nExpress.load(std::memory_order_relaxed) <= 0 || !m_Express.TryPop(Data))
+      return false;
+
+    --m_nExpress;
+    return true;
+  }
+
+  /*
+   * Safely dequeue up to nMax Data objects at once.
+   * @param vData It'll receive the top items of the queue (appended, in processing order).
+   * @param nMax Maximum number of items.
+   * @return true if there is data.
+   */
+  bool TryDequeueBatch(std::vector<SData> &vData, size_t nMax) {
+    size_t nCount = m_Queue.TryPopBatch(vData, nMax);
+    m_nQueued -= static_cast<long>(nCount);
+    if (ServiceStats())
+      for (size_t i = vData.size() - nCount; i < vData.size(); ++i)
+        m_Stats.OnDeparture(vData[i].nPriority);
+
+    return nCount > 0;
+  }
+
   /*
    * Override this function to process your data inside the thread.
    * @param nMessageID The message ID, so you can control what/how to process a Data object.
@@ -115,6 +757,14 @@ protected:
    */
   virtual void Process(int nMessageID, const SData &Data) = 0;
 
+  /*
+   * Override this function to prefetch what a message points to (see SetPrefetchDistance).
+   * It runs a few messages ahead of Process, so it must only issue PrefetchRead hints (no loads
+   * that could miss), e.g. PrefetchRead(Data.Data.data()).
+   * @param Data A message that'll be processed soon.
+   */
+  virtual void PrefetchPayload(const SData &Data) { (void)Data; }
+
   /*
    * Override this function to process something before entering the thread loop.
    * It'll be processed in the thread object context.
@@ -124,12 +774,44 @@ protected:
   /*
    * Override this function to process something after the thread loop.
    * It'll be processed in the thread object context.
-   * As default, we finish processing the thread's queue.
+   * As default, we finish processing the thread's queue (express lane first), as far as the Stop
+   * mode allows it. With SetParallelDrain, the backlog is spread over helper threads.
+   * @see Stop
+   * @see SetParallelDrain
    */
   virtual void ProcessThreadEpilogue() {
+    if (StopCutoff())
+      return;
+    m_nStopProcessed += ProcessExpress();
+
+    if (m_nDrainHelpers > 0) {
+      // The first consumer to get here spawns the helpers, every consumer drains chunks.
+      std::vector<std::thread> vHelpers;
+      std::vector<std::future<void>> vPooledHelpers;
+      if (!m_bDrainStarted.exchange(true)) {
+        for (int i = 0; i < m_nDrainHelpers; ++i) {
+          if (m_bPooledThreads)
+            vPooledHelpers.push_back(CThreadPool::Shared().Run([this] { DrainChunks(); }));
+          else
+            vHelpers.emplace_back(&CDaemon::DrainChunks, this);
+        }
+      }
+
+      DrainChunks();
+      for (std::thread &Helper : vHelpers)
+        Helper.join();
+      for (std::future<void> &Helper : vPooledHelpers)
+        Helper.get();
+      DrainRetries();
+      return;
+    }
+
     SData Data;
-    while (TryDequeue(Data))
-      Process(Data.nMessageID, Data);
+    while (!StopCutoff() && TryDequeue(Data)) {
+      Dispatch(Data);
+      ++m_nStopProcessed;
+    }
+    DrainRetries();
   }
 
   /*
@@ -144,9 +826,45 @@ protected:
    */
   virtual void ProcessAfterQueue() {}
 
+  /*
+   * Override this function to do background work (compaction, cache warming...) while the queue
+   * is empty. It's called when the thread was idle for the interval set by SetIdleInterval, and
+   * again after every interval while it stays idle.
+   * It'll be processed in the thread object context.
+   * @param Budget Stop as soon as Budget.ShouldYield() is true, so idle work never delays a
+   * message.
+   * @see SetIdleInterval
+   */
+  virtual void OnIdle(const CIdleBudget &Budget) { (void)Budget; }
+
+  /*
+   * Override this function for time driven work (flushing buffers, emitting metrics...).
+   * It's called every period set by SetTickPeriod, whether messages arrive or not, between two
+   * dequeue rounds (it never interrupts Process).
+   * It'll be processed in the thread object context.
+   * @param dtNow Current time.
+   * @see SetTickPeriod
+   */
+  virtual void OnTick(std::chrono::steady_clock::time_point dtNow) { (void)dtNow; }
+
+  /*
+   * Override this function to raise an alarm when a Process call hangs.
+   * It's called once per message, when its Process call is running for longer than the threshold
+   * set by SetStallThreshold (give or take a quarter of it).
+   * It'll be processed in the shared watchdog thread, while the stalled Process call is still
+   * running: keep it short and don't start, stop or destroy daemons from it.
+   * @param nMessageID ID of the stalled message.
+   * @param Elapsed How long it's been processing.
+   * @see SetStallThreshold
+   */
+  virtual void OnStall(int nMessageID, std::chrono::nanoseconds Elapsed) {
+    (void)nMessageID;
+    (void)Elapsed;
+  }
+
 private:
   /*
-   * This is the function that the thread object will run.
+   * This is the function that the thread objects will run (each consumer thread runs it).
    * There is no need to override/overload this function.
    * Checkout these functions:
    * @see Process
@@ -154,23 +872,31 @@ private:
    * @see ProcessThreadEpilogue
    * @see ProcessPreQueue
    * @see ProcessAfterQueue
+   * @see OnIdle
+   * @see OnTick
+   * @see OnStall
    */
   void Execute() {
+    if (m_bWatched)
+      tl_pWatchSlot = AcquireWatchSlot();
+
     // Process something before entering the thread loop in this thread context.
     ProcessThreadPreamble();
 
+    std::vector<SData> vBatch; // Batched dequeue buffer, reused between rounds
+    if (m_nBatchSize > 1)
+      vBatch.reserve(std::min<size_t>(m_nBatchSize, 1024));
+
+    auto dtIdleSince = std::chrono::steady_clock::time_point::min();
     while (m_bIsRunning) {
-      {
-        // We wait in this context until there is something to process.
-        std::unique_lock<std::mutex> lock(m_Mutex);
-        m_ConditionVar.wait(lock, [&] {
-          // To process something one of those things should happen:
-          // a) Queue is not empty;
-          // b) We didn't call stop (to exit the loop);
-          // c) The sleep function was called while this thread was idle;
-          return !m_Queue.empty() || !m_bIsRunning.load() || m_nSleepMs.load() > 0;
-        });
-      }
+      // Time driven work runs even when the thread is always busy
+      if (m_TickPeriod.count() > 0)
+        TickIfDue(std::chrono::steady_clock::now());
+
+      // We wait in this context until there is something to process.
+      if (!WaitForWork(dtIdleSince))
+        continue;
+      dtIdleSince = std::chrono::steady_clock::time_point::min();
 
       if (int nSleep = m_nSleepMs) {
         m_bIsSleeping = true;
@@ -183,12 +909,45 @@ private:
       // Process something before the queue
       ProcessPreQueue();
 
+      // Express lane goes first, then the retries that are due
+      ProcessExpress();
+      if (m_nRetries.load(std::memory_order_relaxed) > 0)
+        ProcessRetries();
+
       // Process the queue
-      {
+      if (m_nBatchSize > 1) {
+        if (TryDequeueBatch(vBatch, m_nBatchSize)) {
+          // One clock read per dequeue round
+          bool bRegisterDelay = Timestamped();
+          auto dtNow = bRegisterDelay ? Now() : std::chrono::steady_clock::time_point();
+          size_t nPrefetch = std::min(m_nPrefetchDistance, vBatch.size());
+          for (size_t i = 0; i < nPrefetch; ++i)
+            Prefetch(vBatch[i]);
+          for (size_t i = 0; i < vBatch.size(); ++i) {
+            if (StopCutoff()) {
+              // Stopping, give the rest of the batch back so Stop can account for it
+              SetAsideRest(vBatch, i);
+              break;
+            }
+            if (m_nExpress.load(std::memory_order_relaxed) > 0)
+              ProcessExpress();
+            if (bRegisterDelay)
+              RegisterDelayToProcess(vBatch[i], dtNow);
+            if (nPrefetch > 0 && i + nPrefetch < vBatch.size())
+              Prefetch(vBatch[i + nPrefetch]); // Loads while vBatch[i] is processed
+            Dispatch(vBatch[i]);
+            if (!m_bIsRunning.load(std::memory_order_relaxed))
+              ++m_nStopProcessed; // Rest of the batch processed while stopping
+          }
+          vBatch.clear();
+        }
+      } else {
         SData Data;
         if (TryDequeue(Data)) {
-          Process(Data.nMessageID, Data);
-          RegisterDelayToProcess(Data);
+          // One clock read per dequeue round
+          if (Timestamped())
+            RegisterDelayToProcess(Data, Now());
+          Dispatch(Data);
         }
       }
 
@@ -198,7 +957,11 @@ private:
 
     // Process something after exiting the thread loop in this thread context.
     ProcessThreadEpilogue();
-    m_bFinished = true;
+    tl_pWatchSlot = nullptr;
+    if (--m_nActive == 0) {
+      m_bFinished = true;
+      m_AllDone.set_value();
+    }
   }
 
 public:
@@ -224,35 +987,107 @@ public:
   virtual ~CDaemon() {
     if (m_bIsRunning)
       Stop(); // It'll call the join function
-    else if (m_Thread.joinable())
-      m_Thread.join(); // We wait for this thread to finish
+    else
+      Join(); // We wait for this thread to finish
   }
 
   /*
    * Starts the thread.
+   * A stopped daemon can be started again, the messages enqueued meanwhile are kept.
    */
   void Start() {
     if (not m_bIsRunning) {
+      Join(); // In case the daemon stopped by itself (e.g. an exception in a pooled thread)
+
+      // Reset the state left by the previous run
+      m_bFinished = false;
+      m_nSleepMs = 0;
+      m_bIsSleeping = false;
+      m_eStopMode = EStopMode::DrainAll;
+      m_bDrainStarted = false;
+      m_nActive = m_nConsumerThreads;
+      m_StopSource = CStopSource();
+      m_StopToken = m_StopSource.get_token();
+      m_AllDone = std::promise<void>();
+      m_AllDoneFuture = m_AllDone.get_future();
+      m_nNextTick = (std::chrono::steady_clock::now() +
+                     std::chrono::duration_cast<std::chrono::steady_clock::duration>(m_TickPeriod))
+                        .time_since_epoch()
+                        .count();
+      if (m_StallThreshold.count() > 0)
+        Watch();
+
       m_bIsRunning = true;
-      m_Thread = std::thread(&CDaemon<T>::Execute, this);
+      for (int i = 0; i < m_nConsumerThreads; ++i) {
+        if (m_bPooledThreads)
+          m_vPooled.push_back(CThreadPool::Shared().Run([this] { Execute(); }));
+        else
+          m_vThreads.emplace_back(&CDaemon::Execute, this);
+      }
     }
   }
 
   /*
    * Stops the thread execution.
    * It'll make the calling thread to wait this one.
+   * @param eMode What to do with the messages still queued:
+   * a) EStopMode::DrainAll: process all of them (ProcessThreadEpilogue);
+   * b) EStopMode::DrainUntilDeadline: process them until dtDeadline, the rest is returned in
+   * SStopReport::vLeftovers, in processing order (express lane, the batches cut off, the queue
+   * and the pending retries; with several consumers their batch tails are concatenated);
+   * c) EStopMode::Abort: only finish the message being processed, the rest is discarded.
+   * @param dtDeadline Deadline for EStopMode::DrainUntilDeadline.
+   * @return How many messages were processed and discarded while stopping.
    */
-  void Stop() {
-    {
-      std::scoped_lock<std::mutex> lock(m_Mutex);
+  SStopReport Stop(EStopMode eMode = EStopMode::DrainAll,
+                   std::chrono::steady_clock::time_point dtDeadline = {}) {
+    SStopReport sReport;
+    m_Wait.NotifyAll([&] {
+      m_eStopMode = eMode;
+      m_dtStopDeadline = dtDeadline;
+      m_nStopProcessed = 0;
       m_bIsRunning = false;
-    }
+    });
 
-    m_ConditionVar.notify_one();
+    // Cooperative cancellation: the handlers are asked to give up once the backlog isn't wanted
+    if (eMode == EStopMode::Abort)
+      m_StopSource.request_stop();
+    else if (eMode == EStopMode::DrainUntilDeadline && m_AllDoneFuture.valid() &&
+             m_AllDoneFuture.wait_until(dtDeadline) == std::future_status::timeout)
+      m_StopSource.request_stop();
 
     // We wait for this thread to finish processing
-    if (m_Thread.joinable())
-      m_Thread.join();
+    Join();
+    m_StopSource.request_stop(); // The run is over
+    sReport.nProcessed = m_nStopProcessed.load();
+
+    // Whatever wasn't processed is taken out of the queue in bulk
+    if (eMode != EStopMode::DrainAll) {
+      SData Data;
+      while (TryDequeueExpress(Data))
+        sReport.vLeftovers.push_back(std::move(Data));
+      {
+        std::scoped_lock<std::mutex> lock(m_CutOffMutex);
+        std::move(m_vCutOff.begin(), m_vCutOff.end(), std::back_inserter(sReport.vLeftovers));
+        m_vCutOff.clear();
+      }
+      TryDequeueBatch(sReport.vLeftovers, SIZE_MAX);
+      SRetry Retry;
+      while (TakeRetry(Retry, true))
+        sReport.vLeftovers.push_back(std::move(Retry.Data));
+
+      // Scheduler work isn't handed back, its receivers complete with set_stopped
+      auto itTasks = std::stable_partition(sReport.vLeftovers.begin(), sReport.vLeftovers.end(),
+                                           [](const SData &Data) { return Data.pTask == nullptr; });
+      for (auto it = itTasks; it != sReport.vLeftovers.end(); ++it)
+        it->pTask->Cancel();
+      sReport.nDiscarded = sReport.vLeftovers.size();
+      sReport.vLeftovers.erase(itTasks, sReport.vLeftovers.end());
+      if (eMode == EStopMode::Abort)
+        sReport.vLeftovers.clear();
+    }
+
+    return sReport;
   }
 
   /*
@@ -267,11 +1102,222 @@ public:
    */
   void Sleep(int nMs) {
     if (not m_bIsSleeping) {
-      m_nSleepMs = nMs;
-      m_ConditionVar.notify_one();
+      m_Wait.NotifyAll([&] { m_nSleepMs = nMs; });
     }
   }
 
+  /*
+   * How many threads consume the queue (default 1).
+   * With more than one, Process and the other hooks run concurrently in every consumer thread.
+   * Call it before Start.
+   * @param nThreads Number of consumer threads.
+   */
+  void SetConsumerThreads(int nThreads) {
+    m_nConsumerThreads = nThreads > 0 ? nThreads : 1;
+    if constexpr (SQueueHasSetConsumers<CQueue>::value)
+      m_Queue.SetConsumers(static_cast<size_t>(m_nConsumerThreads));
+  }
+
+  /*
+   * Idle hook: call OnIdle when the queue was empty for Interval.
+   * Call it before Start.
+   * @param Interval Idle time before calling OnIdle, 0 disables the hook.
+   * @param Budget How long each OnIdle call may take.
+   * @see OnIdle
+   */
+  void SetIdleInterval(std::chrono::milliseconds Interval, std::chrono::microseconds Budget) {
+    m_IdleInterval = Interval;
+    m_IdleBudget = Budget;
+  }
+
+  /*
+   * Retry policy for the messages whose Process call throws (off by default: the exception
+   * escapes the consumer thread, as usual).
+   * A failed message is scheduled again after InitialBackoff, doubling on every failure up to
+   * MaxBackoff. The consumer keeps processing the queue meanwhile: the pending retries wait in a
+   * timed queue and are processed, before the queue, once they're due. A message that fails
+   * nMaxAttempts times goes to the dead letter queue (see TakeDeadLetters).
+   * A Stop with EStopMode::DrainAll waits for the pending retries, the other modes treat them like
+   * the rest of the backlog.
+   * Call it before Start.
+   * @param nMaxAttempts Process calls per message, 0 disables the policy (1 catches the exception
+   * and moves the message to the dead letter queue right away).
+   * @param InitialBackoff Delay before the first retry.
+   * @param MaxBackoff Maximum delay between two attempts.
+   * @param nDeadLetterCapacity Dead letter queue bound, the oldest letters are dropped past it.
+   * @see TakeDeadLetters
+   */
+  void SetRetryPolicy(int nMaxAttempts, std::chrono::milliseconds InitialBackoff,
+                      std::chrono::milliseconds MaxBackoff, size_t nDeadLetterCapacity = 1024) {
+    m_nMaxAttempts = nMaxAttempts > 0 ? nMaxAttempts : 0;
+    m_InitialBackoff = InitialBackoff;
+    m_MaxBackoff = std::max(MaxBackoff, InitialBackoff);
+    m_nDeadLetterCapacity = nDeadLetterCapacity;
+  }
+
+  /*
+   * Takes the dead letter queue content, oldest first.
+   * @see SetRetryPolicy
+   */
+  std::vector<SDeadLetter> TakeDeadLetters() {
+    std::scoped_lock<std::mutex> lock(m_RetryMutex);
+    std::vector<SDeadLetter> vLetters(std::make_move_iterator(m_DeadLetters.begin()),
+                                      std::make_move_iterator(m_DeadLetters.end()));
+    m_DeadLetters.clear();
+    return vLetters;
+  }
+
+  /*
+   * How many letters are in the dead letter queue.
+   */
+  size_t DeadLetterCount() const {
+    std::scoped_lock<std::mutex> lock(m_RetryMutex);
+    return m_DeadLetters.size();
+  }
+
+  /*
+   * How many dead letters were dropped because the dead letter queue was full.
+   */
+  size_t DroppedDeadLetters() const {
+    std::scoped_lock<std::mutex> lock(m_RetryMutex);
+    return m_nDroppedDeadLetters;
+  }
+
+  /*
+   * How many messages are waiting for a retry.
+   */
+  size_t PendingRetries() const {
+    return static_cast<size_t>(std::max<long>(m_nRetries.load(), 0));
+  }
+
+  /*
+   * Stall watchdog: call OnStall when a Process call runs for longer than Threshold.
+   * Every daemon shares a single monitor thread (CWatchdog::Shared()), each processing thread
+   * only publishes its in flight message (one clock read and a few relaxed stores per message).
+   * Call it before Start.
+   * @param Threshold Stall threshold, 0 disables the watchdog.
+   * @see OnStall
+   */
+  void SetStallThreshold(std::chrono::milliseconds Threshold) { m_StallThreshold = Threshold; }
+
+  /*
+   * Periodic tick: call OnTick every Period, driven by the wait timeout (no extra thread).
+   * Call it before Start.
+   * @param Period Tick period, 0 disables the tick.
+   * @see OnTick
+   */
+  void SetTickPeriod(std::chrono::microseconds Period) { m_TickPeriod = Period; }
+
+  /*
+   * Run the consumer threads (and the parallel drain helpers) in the shared pool of parked
+   * threads (CThreadPool::Shared()) instead of creating them on every Start.
+   * Meant for daemons that are started and stopped often.
+   * Call it before Start.
+   * @param bPooled true to use the pool.
+   */
+  void SetPooledThreads(bool bPooled) { m_bPooledThreads = bPooled; }
+
+  /*
+   * Parallel drain at shutdown (off by default).
+   * When stopping, the backlog is taken in priority ordered chunks by the consumer thread(s) plus
+   * nHelpers extra threads, so Process is called concurrently: only enable it if Process is safe
+   * to run in parallel. The Stop mode and deadline still apply.
+   * Call it before Start (the watchdog sizes its slots for the helpers then), it's ignored while
+   * the daemon runs.
+   * @param nHelpers Extra threads, 0 disables the parallel drain.
+   * @param nChunk Messages taken from the queue at once by each thread.
+   * @see Stop
+   */
+  void SetParallelDrain(int nHelpers, size_t nChunk = 256) {
+    if (m_bIsRunning)
+      return;
+    m_nDrainHelpers = nHelpers > 0 ? nHelpers : 0;
+    m_nDrainChunk = nChunk > 0 ? nChunk : 1;
+  }
+
+  /*
+   * Batched dequeue: how many messages each thread dequeues per round (default 1).
+   * The batch is taken from the queue engine in one go (one lock acquisition for the default
+   * engine, one buffer swap for CDoubleBufferQueue) and then processed with no lock held.
+   * ProcessPreQueue and ProcessAfterQueue run once per batch.
+   * Call it before Start.
+   * @param nMessages Maximum batch size, SIZE_MAX takes everything that is queued.
+   */
+  void SetBatchSize(size_t nMessages) { m_nBatchSize = nMessages > 0 ? nMessages : 1; }
+
+  /*
+   * Software prefetching in batched dequeue mode (off by default): while a message is processed,
+   * the one nDistance positions further in the batch is prefetched (its SData and, through
+   * PrefetchPayload, its payload), so Process doesn't stall on a cache miss per message when T
+   * points to large or scattered memory. Tune nDistance so the prefetch lands before the message
+   * is processed (roughly memory latency / Process time), app/PrefetchBench.cc measures it.
+   * Call it before Start.
+   * @param nDistance Messages prefetched ahead, 0 disables it.
+   * @see SetBatchSize
+   * @see PrefetchPayload
+   */
+  void SetPrefetchDistance(size_t nDistance) { m_nPrefetchDistance = nDistance; }
+
+  /*
+   * Service statistics: per priority service time, arrival rate and queued messages (off by
+   * default, it costs two clock reads per processed message).
+   * Call it before Start and before enqueueing anything, so the queued counts start at 0.
+   * @param bEnabled true to keep the statistics.
+   * @see ExpectedWait
+   */
+  void SetServiceStats(bool bEnabled) { m_bServiceStats = bEnabled; }
+
+  /*
+   * How long a message enqueued now at nPriority would wait before being processed (seconds).
+   * It's the work queued ahead of it (same or higher priority messages times their service time)
+   * spread over the consumer threads and stretched by the load of the higher priorities that keep
+   * arriving meanwhile. Infinity when the higher priorities alone saturate the consumers.
+   * Needs SetServiceStats(true), it's always 0 otherwise.
+   * @param nPriority Priority of the message.
+   */
+  double ExpectedWait(int nPriority) {
+    return ServiceStats() ? m_Stats.ExpectedWait(nPriority, m_nConsumerThreads) : 0.0;
+  }
+
+  /*
+   * Admission control: SafeAddMessage rejects the messages whose expected queueing delay (see
+   * ExpectedWait), or the delay observed for their priority, exceeds the SLO. The rejections are
+   * counted per priority (CServiceStats::Rejected).
+   * It enables the service statistics. The observed delay needs a clock policy other than
+   * EClockPolicy::None, without one only the expected delay is checked. Everything is accepted
+   * until the first message is processed (there's no service time estimate before that).
+   * Call it before Start and before enqueueing anything.
+   * @param SLO Maximum queueing delay, 0 disables the admission control.
+   * @see SafeAddMessage
+   */
+  void SetLatencySLO(std::chrono::microseconds SLO) {
+    m_LatencySLO = SLO;
+    if (SLO.count() > 0)
+      m_bServiceStats = true;
+  }
+
+  /*
+   * Service statistics (see SetServiceStats).
+   */
+  const CStats &GetServiceStats() const { return m_Stats; }
+
+  /*
+   * Queue engine, to tune it or read its metrics (e.g. CMultiQueue::GetRankError).
+   */
+  CQueue &GetQueue() { return m_Queue; }
+
+  /*
+   * Selects how the messages are timestamped.
+   * Call it before Start, the messages already enqueued keep their timestamps.
+   * @param eClockPolicy The clock policy.
+   * @see EClockPolicy
+   */
+  void SetClockPolicy(EClockPolicy eClockPolicy) {
+    if (eClockPolicy == EClockPolicy::Tsc)
+      CTscClock::Calibrate(); // Don't make the first message pay for the calibration
+    m_eClockPolicy = eClockPolicy;
+  }
+
   /*
    * Did this thread finish the processing?
    */
@@ -280,17 +1326,265 @@ public:
   /*
    * Enqueue a data object.
    * @param data The data object that'll be processed by this thread.
+   * @return EAddResult::Rejected if the admission control turned it down (see SetLatencySLO) or
+   * the bounded queue engine is full (see CBoundedQueue).
    * @see SData
    */
-  void SafeAddMessage(const SData &Data) {
-    {
-      std::scoped_lock<std::mutex> lock(m_Mutex);
-      m_Queue.push(std::move(Data));
+  EAddResult SafeAddMessage(const SData &Data) { return SafeAddMessage(SData(Data)); }
+
+  /*
+   * Enqueue a data object.
+   * @param data The data object that'll be moved to this thread's queue.
+   * @return EAddResult::Rejected if the admission control turned it down (see SetLatencySLO) or
+   * the bounded queue engine is full (see CBoundedQueue), Data is left untouched then.
+   * @see SData
+   */
+  EAddResult SafeAddMessage(SData &&Data) {
+    if (m_LatencySLO.count() > 0 && !Admit(Data.nPriority))
+      return EAddResult::Rejected;
+
+    if (Timestamped())
+      Stamp(Data, Now());
+
+    if constexpr (SQueueHasTryPush<CQueue, SData>::value) {
+      // Bounded engine, a full queue rejects the message
+      int nPriority = Data.nPriority;
+      if (!m_Queue.TryPush(std::move(Data)))
+        return EAddResult::Rejected;
+      if (ServiceStats())
+        m_Stats.OnArrival(nPriority);
+    } else {
+      if (ServiceStats())
+        m_Stats.OnArrival(Data.nPriority);
+      m_Queue.Push(std::move(Data));
     }
+    ++m_nQueued;
 
     // Notify thread object that there is data to process
-    m_ConditionVar.notify_one();
+    WakeUp();
+    return EAddResult::Accepted;
   }
+
+  /*
+   * Enqueue a data object in the express lane.
+   * The express lane is a small lock free ring checked before the queue on every round, and
+   * between the messages of a batch, so critical messages (cancellations, health pings...) skip
+   * the backlog. The priority is ignored, express messages are processed in arrival order.
+   * No lock is taken unless a thread is waiting for work.
+   * @param Data The data object that'll be processed by this thread.
+   * @return false if the express lane is full (the message isn't enqueued).
+   * @see SData
+   */
+  bool SafeAddExpress(SData Data) {
+    if (Timestamped())
+      Stamp(Data, Now());
+
+    if (!m_Express.TryPush(std::move(Data)))
+      return false;
+    ++m_nExpress;
+
+    WakeUp();
+    return true;
+  }
+
+  /*
+   * Enqueue scheduler work (see GetScheduler), it runs on a consumer thread in priority order with
+   * the messages. Nothing is allocated: the queued message only points to Task.
+   * The admission control (SetLatencySLO) doesn't apply to it. It never waits for room: with a
+   * bounded queue engine (see CBoundedQueue), if the queue is full the task is cancelled right away
+   * (its receiver completes with set_stopped in the calling thread).
+   * @param Task The work, it must stay alive until it runs or is cancelled (Stop).
+   * @param nPriority Its priority.
+   * @see kTaskMessageID
+   */
+  void SafeAddTask(CScheduledTask &Task, int nPriority) {
+    SData Data;
+    Data.nPriority = nPriority;
+    Data.nMessageID = kTaskMessageID;
+    Data.pTask = &Task;
+    if (Timestamped())
+      Stamp(Data, Now());
+
+    if constexpr (SQueueHasTryPush<CQueue, SData>::value) {
+      if (!m_Queue.TryPush(std::move(Data))) {
+        Task.Cancel();
+        return;
+      }
+    } else {
+      m_Queue.Push(std::move(Data));
+    }
+    ++m_nQueued;
+    WakeUp();
+  }
+
+  /*
+   * Sender/receiver scheduler of this daemon (see Scheduler.cc): schedule() completes on a
+   * consumer thread, so a sender chain can hop onto the daemon without a wrapper message.
+   * @param nPriority Priority of the scheduled work, unless the receiver environment answers the
+   * get_priority query.
+   */
+  CDaemonScheduler<CDaemon> GetScheduler(int nPriority = 0) {
+    return CDaemonScheduler<CDaemon>(*this, nPriority);
+  }
+
+  /*
+   * Enqueue several data objects at once.
+   * The whole batch is inserted under a single lock acquisition and timestamped with a single
+   * clock read.
+   * @param vData The data objects, they're moved to this thread's queue and the vector is cleared
+   * (its capacity is kept, so it can be reused as a staging buffer). With a bounded queue engine
+   * (see CBoundedQueue), what doesn't fit is left in vData, in order.
+   * The admission control (SetLatencySLO) doesn't apply to bulk enqueues.
+   * @return How many messages were enqueued.
+   * @see SData
+   */
+  size_t SafeAddMessages(std::vector<SData> &vData) {
+    if (vData.empty())
+      return 0;
+
+    if (Timestamped()) {
+      auto dtNow = Now();
+      for (SData &Data : vData)
+        Stamp(Data, dtNow);
+    }
+
+    size_t nCount = vData.size();
+    if constexpr (SQueueHasTryPush<CQueue, SData>::value) {
+      // Bounded engine: never wait for room here, the consumers don't know about the messages
+      // before m_nQueued is published. The rest is rejected (left in vData).
+      for (nCount = 0; nCount < vData.size(); ++nCount) {
+        int nPriority = vData[nCount].nPriority;
+        if (!m_Queue.TryPush(std::move(vData[nCount])))
+          break;
+        if (ServiceStats())
+          m_Stats.OnArrival(nPriority);
+      }
+      vData.erase(vData.begin(), vData.begin() + static_cast<std::ptrdiff_t>(nCount));
+    } else {
+      if (ServiceStats())
+        for (const SData &Data : vData)
+          m_Stats.OnArrival(Data.nPriority);
+      m_Queue.PushBulk(vData);
+    }
+    if (nCount == 0)
+      return 0;
+    m_nQueued += static_cast<long>(nCount);
+
+    WakeUp(nCount);
+    return nCount;
+  }
+
+  /*
+   * Producer side staging buffer.
+   * Instead of locking the daemon queue for every message, the messages are staged locally and
+   * handed to the daemon in bulk (SafeAddMessages) when:
+   * a) The buffer holds nMaxMessages messages;
+   * b) The oldest staged message waited more than the latency budget. Add checks it, and so does
+   * FlushIfDue: a producer that may go quiet calls it from its own loop or wait timeout (see
+   * Deadline), otherwise the last staged messages wait for the next Add;
+   * c) Flush is called (also called by the destructor).
+   * It needs an unbounded queue engine: a bounded one (see CBoundedQueue) may refuse messages, and
+   * a staging buffer has nobody to hand them back to once its producer moved on (its destructor).
+   * With a bounded engine, call SafeAddMessages directly: what doesn't fit is left in the vector.
+   * Keep one per producer thread (e.g. a thread_local object), it isn't thread safe.
+   * The message delay (GetLastDelay) is measured from the flush, not from the Add call.
+   */
+  class CStagingBuffer {
+    static_assert(!SQueueHasTryPush<CQueue, SData>::value,
+                  "CStagingBuffer can't be used with a bounded queue engine, use SafeAddMessages");
+
+  private:
+    CDaemon &m_Daemon;                               // Daemon that receives the messages.
+    std::vector<SData> m_vStaged;                    // Staged messages.
+    size_t m_nMaxMessages;                           // Flush when we reach this many messages.
+    std::chrono::microseconds m_LatencyBudget;       // Flush when the oldest message is this old.
+    std::chrono::steady_clock::time_point m_dtFirst; // When the oldest staged message was added.
+
+  public:
+    /*
+     * Constructor.
+     * @param Daemon The daemon that'll process the messages.
+     * @param nMaxMessages Flush when this many messages are staged.
+     * @param LatencyBudget Flush when the oldest staged message is older than this, 0 disables it.
+     */
+    CStagingBuffer(CDaemon &Daemon, size_t nMaxMessages,
+                   std::chrono::microseconds LatencyBudget = std::chrono::microseconds(0))
+        : m_Daemon(Daemon), m_nMaxMessages(nMaxMessages > 0 ? nMaxMessages : 1),
+          m_LatencyBudget(LatencyBudget) {
+      m_vStaged.reserve(m_nMaxMessages);
+    }
+
+    CStagingBuffer(const CStagingBuffer &) = delete;
+    CStagingBuffer &operator=(const CStagingBuffer &) = delete;
+
+    /*
+     * Destructor.
+     * Hands whatever is left to the daemon.
+     */
+    ~CStagingBuffer() { Flush(); }
+
+    /*
+     * Stages a data object, it may flush the buffer.
+     * @param Data The data object that'll be processed by the daemon.
+     */
+    void Add(SData Data) {
+      bool bCheckBudget = m_LatencyBudget.count() > 0;
+      auto dtNow = bCheckBudget ? std::chrono::steady_clock::now()
+                                : std::chrono::steady_clock::time_point();
+      if (m_vStaged.empty())
+        m_dtFirst = dtNow;
+
+      m_vStaged.push_back(std::move(Data));
+
+      if (m_vStaged.size() >= m_nMaxMessages ||
+          (bCheckBudget && dtNow - m_dtFirst >= m_LatencyBudget))
+        Flush();
+    }
+
+    /*
+     * Hands all the staged messages to the daemon.
+     * @return How many were enqueued.
+     */
+    size_t Flush() { return m_Daemon.SafeAddMessages(m_vStaged); }
+
+    /*
+     * Flushes the buffer if the oldest staged message is past the latency budget.
+     * @return How many were enqueued.
+     */
+    size_t FlushIfDue() {
+      if (m_vStaged.empty() || m_LatencyBudget.count() == 0 ||
+          std::chrono::steady_clock::now() < Deadline())
+        return 0;
+      return Flush();
+    }
+
+    /*
+     * When the staged messages are due (time_point::max() if nothing is staged or there is no
+     * latency budget), e.g. the timeout of the producer's own wait before calling FlushIfDue.
+     */
+    std::chrono::steady_clock::time_point Deadline() const {
+      if (m_vStaged.empty() || m_LatencyBudget.count() == 0)
+        return std::chrono::steady_clock::time_point::max();
+      return m_dtFirst + m_LatencyBudget;
+    }
+
+    /*
+     * How many messages are staged.
+     */
+    size_t Size() const { return m_vStaged.size(); }
+  };
 };
 
+/*
+ * Real time daemon: fixed capacity (nCapacity messages, a power of two, stored inline with their
+ * T), lock free bounded queue, spin waiting, no timestamps and no statistics. Once started,
+ * SafeAddMessage and the consumer loop neither allocate nor make a blocking system call, as long
+ * as T doesn't allocate either (use inline storage, e.g. std::array). With SetBatchSize, keep it
+ * at most 1024: the batch buffer is then only allocated once, when the consumer thread starts.
+ * A full queue rejects the message (EAddResult::Rejected). app/RealTimeCheck.cc verifies it.
+ */
+template <class T, size_t nCapacity = 1024>
+using CRealTimeDaemon = CDaemon<T, SBoundedQueue<nCapacity>::template CEngine,
+                                SDaemonPolicy<CSpinWait, CNoClock, CNoStats>>;
+
 #endif // DAEMON_NS_H
@@ -0,0 +1,128 @@
+#ifndef DOUBLE_BUFFER_QUEUE_NS_H
+#define DOUBLE_BUFFER_QUEUE_NS_H
+#ifdef DOUBLE_BUFFER_QUEUE_NS_H
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <ThreadWrapper/SpinLock.cc>
+#endif
+
+/*
+ * Double buffered FIFO queue engine for CDaemon (see HeapQueue.cc for the engine interface).
+ * Producers append to the front buffer under a short lock. The consumer swaps the whole front
+ * buffer with its own (empty) one in a single exchange and then hands the messages out with no
+ * producer lock held, so the lock is taken once per burst instead of once per message.
+ * The priority is ignored: messages are dequeued in arrival order. Use it for FIFO tolerant
+ * daemons, ideally with CDaemon::SetBatchSize so a whole burst is dequeued at once.
+ * TLock is the locking policy: CDoubleBufferQueue uses std::mutex and CSpinDoubleBufferQueue
+ * CSpinLock.
+ * Usage: CDaemon<T, CDoubleBufferQueue>.
+ */
+template <class TData, class TCompare, class TLock> class CBasicDoubleBufferQueue {
+private:
+  std::vector<TData> m_vFront;    // Producer side buffer.
+  TLock m_ProducerMutex;          // Protects m_vFront.
+  std::vector<TData> m_vBack;     // Consumer side buffer.
+  size_t m_nNext = 0;             // Next object to hand out from m_vBack.
+  TLock m_ConsumerMutex;          // Protects m_vBack (only contended with several consumers).
+  std::atomic<long> m_nSize = 0;  // Queued objects, both buffers (may be -1 while a push lands).
+
+  /*
+   * Swaps the buffers when the consumer side is drained.
+   * Must be called with m_ConsumerMutex held.
+   * @return false if there is nothing to hand out.
+   */
+  bool Refill() {
+    if (m_nNext < m_vBack.size())
+      return true;
+
+    m_vBack.clear();
+    m_nNext = 0;
+    {
+      std::scoped_lock<TLock> lock(m_ProducerMutex);
+      m_vFront.swap(m_vBack);
+    }
+    return !m_vBack.empty();
+  }
+
+public:
+  /*
+   * Enqueue one object.
+   */
+  void Push(TData &&Data) {
+    {
+      std::scoped_lock<TLock> lock(m_ProducerMutex);
+      m_vFront.push_back(std::move(Data));
+    }
+    ++m_nSize;
+  }
+
+  /*
+   * Enqueue several objects under a single lock.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    size_t nCount = vData.size();
+    {
+      std::scoped_lock<TLock> lock(m_ProducerMutex);
+      if (m_vFront.empty())
+        m_vFront.swap(vData);
+      else
+        for (TData &Data : vData)
+          m_vFront.push_back(std::move(Data));
+    }
+    vData.clear();
+    m_nSize += static_cast<long>(nCount);
+  }
+
+  /*
+   * Dequeue the oldest object.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<TLock> lock(m_ConsumerMutex);
+    if (!Refill())
+      return false;
+
+    Data = std::move(m_vBack[m_nNext++]);
+    --m_nSize;
+    return true;
+  }
+
+  /*
+   * Dequeue up to nMax objects.
+   * When the consumer side is drained and vData is empty, the front buffer is swapped straight
+   * into vData, nothing is moved.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<TLock> lock(m_ConsumerMutex);
+    size_t nCount = 0;
+    if (m_nNext >= m_vBack.size() && vData.empty()) {
+      std::scoped_lock<TLock> lockProducer(m_ProducerMutex);
+      if (m_vFront.size() <= nMax) {
+        m_vFront.swap(vData);
+        nCount = vData.size();
+      }
+    }
+
+    for (; nCount < nMax && Refill(); ++nCount)
+      vData.push_back(std::move(m_vBack[m_nNext++]));
+
+    m_nSize -= static_cast<long>(nCount);
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const { return static_cast<size_t>(std::max<long>(m_nSize.load(), 0)); }
+};
+
+template <class TData, class TCompare>
+using CDoubleBufferQueue = CBasicDoubleBufferQueue<TData, TCompare, std::mutex>; // Mutex engine.
+template <class TData, class TCompare>
+using CSpinDoubleBufferQueue = CBasicDoubleBufferQueue<TData, TCompare, CSpinLock>; // Spin lock.
+
+#endif // DOUBLE_BUFFER_QUEUE_NS_H
@@ -0,0 +1,176 @@
+#ifndef FAIR_QUEUE_NS_H
+#define FAIR_QUEUE_NS_H
+#ifdef FAIR_QUEUE_NS_H
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#endif
+
+/*
+ * Per producer fair queue engine for CDaemon (see HeapQueue.cc for the engine interface).
+ * Each producer (TData::nProducerID) has its own sub-queue, ordered by priority, and the
+ * sub-queues are served with deficit round robin: on each visit a producer earns its share in
+ * messages, so a producer flooding the daemon only delays its own messages.
+ * Register the producers (RegisterProducer) to pick their share, an unknown producer ID gets a
+ * share of 1.
+ * Usage: CDaemon<T, CFairQueue>, with SData::nProducerID set by each producer.
+ */
+template <class TData, class TCompare> class CFairQueue {
+private:
+  /*
+   * Producer sub-queue.
+   */
+  struct SFlow {
+    std::vector<TData> vHeap; // Producer messages, by priority.
+    long nShare = 1;          // Messages per round.
+    long nDeficit = 0;        // Messages it may still send this round.
+    bool bActive = false;     // Is it in the round robin list?
+    bool bVisited = false;    // Did it get its share for the current visit?
+  };
+
+  std::unordered_map<int, SFlow> m_Flows; // Sub-queues by producer ID.
+  std::deque<int> m_Active;               // Round robin list of the non empty sub-queues.
+  int m_nNextProducerID = 1;              // Next ID given by RegisterProducer.
+  TCompare m_Compare;                     // Ordering inside a sub-queue.
+  std::atomic<size_t> m_nSize = 0;        // Queued objects.
+  mutable std::mutex m_Mutex;             // Mutex.
+
+  /*
+   * Adds one object to its producer sub-queue.
+   * Must be called with m_Mutex held.
+   */
+  void PushLocked(TData &&Data) {
+    int nProducerID = Data.nProducerID;
+    SFlow &Flow = m_Flows[nProducerID];
+    Flow.vHeap.push_back(std::move(Data));
+    std::push_heap(Flow.vHeap.begin(), Flow.vHeap.end(), m_Compare);
+    if (!Flow.bActive) {
+      Flow.bActive = true;
+      m_Active.push_back(nProducerID);
+    }
+  }
+
+  /*
+   * Deficit round robin dequeue.
+   * Must be called with m_Mutex held.
+   */
+  bool PopLocked(TData &Data) {
+    while (!m_Active.empty()) {
+      SFlow &Flow = m_Flows[m_Active.front()];
+      if (!Flow.bVisited) {
+        Flow.nDeficit += Flow.nShare;
+        Flow.bVisited = true;
+      }
+
+      if (Flow.nDeficit > 0) {
+        std::pop_heap(Flow.vHeap.begin(), Flow.vHeap.end(), m_Compare);
+        Data = std::move(Flow.vHeap.back());
+        Flow.vHeap.pop_back();
+        --Flow.nDeficit;
+
+        if (Flow.vHeap.empty()) {
+          // An idle producer doesn't keep its unused deficit
+          Flow.nDeficit = 0;
+          Flow.bVisited = false;
+          Flow.bActive = false;
+          m_Active.pop_front();
+        }
+        --m_nSize;
+        return true;
+      }
+
+      // Share used, next producer
+      Flow.bVisited = false;
+      m_Active.push_back(m_Active.front());
+      m_Active.pop_front();
+    }
+
+    return false;
+  }
+
+public:
+  /*
+   * Registers a producer.
+   * @param nShare Messages the producer may send on each round robin visit (its weight).
+   * @return The producer ID, to be set in SData::nProducerID.
+   */
+  int RegisterProducer(long nShare = 1) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    int nProducerID = m_nNextProducerID++;
+    m_Flows[nProducerID].nShare = std::max<long>(nShare, 1);
+    return nProducerID;
+  }
+
+  /*
+   * Changes a producer share.
+   * @param nProducerID Producer ID (it doesn't need to be registered).
+   * @param nShare Messages the producer may send on each round robin visit (its weight).
+   */
+  void SetShare(int nProducerID, long nShare) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    m_Flows[nProducerID].nShare = std::max<long>(nShare, 1);
+  }
+
+  /*
+   * How many objects a producer has queued.
+   */
+  size_t ProducerSize(int nProducerID) const {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    auto it = m_Flows.find(nProducerID);
+    return it != m_Flows.end() ? it->second.vHeap.size() : 0;
+  }
+
+  /*
+   * Enqueue one object in its producer sub-queue.
+   */
+  void Push(TData &&Data) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    PushLocked(std::move(Data));
+    ++m_nSize;
+  }
+
+  /*
+   * Enqueue several objects under a single lock.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      for (TData &Data : vData)
+        PushLocked(std::move(Data));
+      m_nSize += vData.size();
+    }
+    vData.clear();
+  }
+
+  /*
+   * Dequeue the next object, in deficit round robin order.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    return PopLocked(Data);
+  }
+
+  /*
+   * Dequeue up to nMax objects under a single lock.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    size_t nCount = 0;
+    TData Data;
+    for (; nCount < nMax && PopLocked(Data); ++nCount)
+      vData.push_back(std::move(Data));
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const { return m_nSize.load(); }
+};
+
+#endif // FAIR_QUEUE_NS_H
@@ -0,0 +1,161 @@
+#ifndef FLAT_COMBINING_QUEUE_NS_H
+#define FLAT_COMBINING_QUEUE_NS_H
+#ifdef FLAT_COMBINING_QUEUE_NS_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/*
+ * Flat combining queue engine for CDaemon (see HeapQueue.cc for the engine interface).
+ * Producers don't fight for the heap lock: each one publishes its request in a free publication
+ * slot and whichever thread holds the combiner lock applies every pending request to the heap in
+ * a single pass. Under many producers the heap lock changes hands once per pass instead of once
+ * per message. The ordering is exactly the same as CHeapQueue.
+ * Usage: CDaemon<T, CFlatCombiningQueue>.
+ */
+template <class TData, class TCompare> class CFlatCombiningQueue {
+private:
+  static constexpr size_t kSlots = 64; // Publication slots, more producers than this is fine.
+
+  /*
+   * Publication slot, it points to the producer's object while the request is pending.
+   * The combiner resets it to nullptr once the object was moved into the heap.
+   */
+  struct alignas(64) SSlot {
+    std::atomic<TData *> pRequest = nullptr;
+  };
+
+  std::array<SSlot, kSlots> m_aSlots; // Publication array.
+  std::vector<TData> m_vHeap;         // Heap storage, only touched with m_Combiner held.
+  TCompare m_Compare;                 // Ordering.
+  std::mutex m_Combiner;              // Combiner lock.
+  std::atomic<size_t> m_nSize = 0;    // Heap size, updated by the combiner.
+
+  /*
+   * First slot a thread tries, so producers don't all start at slot 0.
+   */
+  static size_t HomeSlot() {
+    static thread_local size_t nHome = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return nHome;
+  }
+
+  /*
+   * Applies every pending request to the heap.
+   * Must be called with m_Combiner held.
+   */
+  void Combine() {
+    size_t nHeapSize = m_vHeap.size();
+    for (SSlot &Slot : m_aSlots) {
+      TData *pData = Slot.pRequest.load(std::memory_order_acquire);
+      if (pData != nullptr) {
+        m_vHeap.push_back(std::move(*pData));
+        std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+        Slot.pRequest.store(nullptr, std::memory_order_release); // Request done
+      }
+    }
+
+    if (m_vHeap.size() != nHeapSize)
+      m_nSize.store(m_vHeap.size(), std::memory_order_relaxed);
+  }
+
+public:
+  /*
+   * Enqueue one object.
+   * It returns once the object is in the heap, combined either by this thread or by another one.
+   */
+  void Push(TData &&Data) {
+    // Publish the request in the first free slot.
+    SSlot *pSlot = nullptr;
+    size_t nHome = HomeSlot();
+    for (size_t i = 0; i < kSlots && pSlot == nullptr; ++i) {
+      SSlot &Slot = m_aSlots[(nHome + i) % kSlots];
+      TData *pExpected = nullptr;
+      if (Slot.pRequest.load(std::memory_order_relaxed) == nullptr &&
+          Slot.pRequest.compare_exchange_strong(pExpected, &Data, std::memory_order_release,
+                                                std::memory_order_relaxed))
+        pSlot = &Slot;
+    }
+
+    // Every slot is busy, take the lock like a plain heap queue would.
+    if (pSlot == nullptr) {
+      std::scoped_lock<std::mutex> lock(m_Combiner);
+      Combine();
+      m_vHeap.push_back(std::move(Data));
+      std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      m_nSize.store(m_vHeap.size(), std::memory_order_relaxed);
+      return;
+    }
+
+    // Wait for our request to be combined, becoming the combiner if nobody is.
+    for (int nSpins = 0; pSlot->pRequest.load(std::memory_order_acquire) != nullptr; ++nSpins) {
+      if (m_Combiner.try_lock()) {
+        Combine();
+        m_Combiner.unlock();
+      } else if (nSpins > 64) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  /*
+   * Enqueue several objects, the batch is applied in one go by this thread.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Combiner);
+      Combine();
+      for (TData &Data : vData) {
+        m_vHeap.push_back(std::move(Data));
+        std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      }
+      m_nSize.store(m_vHeap.size(), std::memory_order_relaxed);
+    }
+    vData.clear();
+  }
+
+  /*
+   * Dequeue the top object, pending requests are combined first.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<std::mutex> lock(m_Combiner);
+    Combine();
+    if (m_vHeap.empty())
+      return false;
+
+    std::pop_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+    Data = std::move(m_vHeap.back());
+    m_vHeap.pop_back();
+    m_nSize.store(m_vHeap.size(), std::memory_order_relaxed);
+    return true;
+  }
+
+  /*
+   * Dequeue up to nMax objects, pending requests are combined first.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<std::mutex> lock(m_Combiner);
+    Combine();
+    size_t nCount = 0;
+    for (; nCount < nMax && !m_vHeap.empty(); ++nCount) {
+      std::pop_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      vData.push_back(std::move(m_vHeap.back()));
+      m_vHeap.pop_back();
+    }
+    m_nSize.store(m_vHeap.size(), std::memory_order_relaxed);
+    return nCount;
+  }
+
+  /*
+   * How many objects are in the heap (pending requests not included).
+   */
+  size_t Size() const { return m_nSize.load(std::memory_order_relaxed); }
+};
+
+#endif // FLAT_COMBINING_QUEUE_NS_H
@@ -0,0 +1,147 @@
+#ifndef HEAP_QUEUE_NS_H
+#define HEAP_QUEUE_NS_H
+#ifdef HEAP_QUEUE_NS_H
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <ThreadWrapper/SpinLock.cc>
+#endif
+
+/*
+ * Default queue engine for CDaemon.
+ * A binary heap (same ordering as std::priority_queue) protected by a lock, TLock is the locking
+ * policy: CHeapQueue uses a std::mutex and CSpinHeapQueue a CSpinLock.
+ *
+ * A queue engine is any class template <class TData, class TCompare> that is safe to call from
+ * several threads and provides:
+ * - void Push(TData &&Data);                   Enqueue one object.
+ * - void PushBulk(std::vector<TData> &vData);  Enqueue (move) all the objects and clear vData.
+ * - bool TryPop(TData &Data);                  Dequeue the top object, false if there is none.
+ * - size_t TryPopBatch(std::vector<TData> &vData, size_t nMax);
+ *                                              Append up to nMax objects to vData, in dequeue
+ *                                              order. Returns how many were appended.
+ * - size_t Size() const;                       How many objects are queued (may be approximate).
+ * TCompare follows the std::priority_queue convention: the "largest" element is dequeued first.
+ * Optional members, used by CDaemon when they're there:
+ * - void SetConsumers(size_t nConsumers);      Number of threads that'll call TryPop.
+ * - void OnServiced(const TData &Data, std::chrono::nanoseconds Elapsed);
+ *                                              Process took Elapsed for Data.
+ * - bool TryPush(TData &&Data);                Bounded engines: enqueue one object, false if it's
+ *                                              full (CDaemon::SafeAddMessage rejects it then).
+ */
+template <class TData, class TCompare, class TLock> class CBasicHeapQueue {
+private:
+  std::vector<TData> m_vHeap; // Heap storage.
+  TCompare m_Compare;         // Ordering.
+  mutable TLock m_Mutex;      // Lock.
+
+public:
+  /*
+   * Enqueue one object.
+   */
+  void Push(TData &&Data) {
+    std::scoped_lock<TLock> lock(m_Mutex);
+    m_vHeap.push_back(std::move(Data));
+    std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+  }
+
+  /*
+   * Enqueue several objects under a single lock.
+   * Big batches are appended and re-heapified in O(n) instead of being sifted one by one.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    {
+      std::scoped_lock<TLock> lock(m_Mutex);
+      if (vData.size() > m_vHeap.size()) {
+        std::move(vData.begin(), vData.end(), std::back_inserter(m_vHeap));
+        std::make_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      } else {
+        for (TData &Data : vData) {
+          m_vHeap.push_back(std::move(Data));
+          std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+        }
+      }
+    }
+    vData.clear();
+  }
+
+  /*
+   * Dequeue the top object.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<TLock> lock(m_Mutex);
+    if (m_vHeap.empty())
+      return false;
+
+    std::pop_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+    Data = std::move(m_vHeap.back());
+    m_vHeap.pop_back();
+    return true;
+  }
+
+  /*
+   * Dequeue up to nMax objects under a single lock.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<TLock> lock(m_Mutex);
+    size_t nCount = 0;
+    for (; nCount < nMax && !m_vHeap.empty(); ++nCount) {
+      std::pop_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      vData.push_back(std::move(m_vHeap.back()));
+      m_vHeap.pop_back();
+    }
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const {
+    std::scoped_lock<TLock> lock(m_Mutex);
+    return m_vHeap.size();
+  }
+};
+
+template <class TData, class TCompare>
+using CHeapQueue = CBasicHeapQueue<TData, TCompare, std::mutex>; // Default engine.
+template <class TData, class TCompare>
+using CSpinHeapQueue = CBasicHeapQueue<TData, TCompare, CSpinLock>; // Spin lock engine.
+
+/*
+ * Does the queue engine provide SetConsumers?
+ */
+template <class TEngine, class = void> struct SQueueHasSetConsumers : std::false_type {};
+template <class TEngine>
+struct SQueueHasSetConsumers<
+    TEngine, std::void_t<decltype(std::declval<TEngine &>().SetConsumers(size_t(1)))>>
+    : std::true_type {};
+
+/*
+ * Does the queue engine want the service time feedback (OnServiced)?
+ */
+template <class TEngine, class TData, class = void>
+struct SQueueHasOnServiced : std::false_type {};
+template <class TEngine, class TData>
+struct SQueueHasOnServiced<TEngine, TData,
+                           std::void_t<decltype(std::declval<TEngine &>().OnServiced(
+                               std::declval<const TData &>(), std::chrono::nanoseconds()))>>
+    : std::true_type {};
+
+/*
+ * Is the queue engine bounded (TryPush)?
+ */
+template <class TEngine, class TData, class = void> struct SQueueHasTryPush : std::false_type {};
+template <class TEngine, class TData>
+struct SQueueHasTryPush<
+    TEngine, TData,
+    std::void_t<decltype(bool(std::declval<TEngine &>().TryPush(std::declval<TData &&>())))>>
+    : std::true_type {};
+
+#endif // HEAP_QUEUE_NS_H
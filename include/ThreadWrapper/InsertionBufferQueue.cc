@@ -0,0 +1,132 @@
+#ifndef INSERTION_BUFFER_QUEUE_NS_H
+#define INSERTION_BUFFER_QUEUE_NS_H
+#ifdef INSERTION_BUFFER_QUEUE_NS_H
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <vector>
+#endif
+
+/*
+ * Two level queue engine for CDaemon (see HeapQueue.cc for the engine interface).
+ * Producers only append to an unsorted insertion buffer, O(1) under the lock. The consumer owns
+ * the heap: before each dequeue round it takes the insertion buffer (one swap) and merges it into
+ * the heap, sifting the new objects in one by one or re-heapifying everything in O(n) when the
+ * buffer is big compared to the heap. The ordering cost moves from the producers to the consumer
+ * and the dequeue order is the same as CHeapQueue for everything enqueued before the round.
+ * Usage: CDaemon<T, CInsertionBufferQueue>.
+ */
+template <class TData, class TCompare> class CInsertionBufferQueue {
+private:
+  std::vector<TData> m_vInsertion;     // Producer side, unsorted.
+  std::atomic<size_t> m_nInserted = 0; // Objects in m_vInsertion.
+  std::mutex m_ProducerMutex;          // Protects m_vInsertion.
+  std::vector<TData> m_vHeap;          // Consumer side heap.
+  std::vector<TData> m_vSpare;         // Swapped with m_vInsertion, keeps the capacity around.
+  std::mutex m_ConsumerMutex;          // Protects m_vHeap and m_vSpare.
+  TCompare m_Compare;                  // Ordering.
+  std::atomic<long> m_nSize = 0;       // Queued objects, both levels.
+
+  /*
+   * Takes the insertion buffer and merges it into the heap.
+   * Must be called with m_ConsumerMutex held.
+   */
+  void Merge() {
+    if (m_nInserted.load(std::memory_order_acquire) == 0)
+      return;
+
+    {
+      std::scoped_lock<std::mutex> lock(m_ProducerMutex);
+      m_vInsertion.swap(m_vSpare);
+      m_nInserted.store(0, std::memory_order_relaxed);
+    }
+
+    // k log(n + k) sifting vs (n + k) heapify
+    if (m_vSpare.size() * 4 > m_vHeap.size()) {
+      std::move(m_vSpare.begin(), m_vSpare.end(), std::back_inserter(m_vHeap));
+      std::make_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+    } else {
+      for (TData &Data : m_vSpare) {
+        m_vHeap.push_back(std::move(Data));
+        std::push_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+      }
+    }
+    m_vSpare.clear();
+  }
+
+  /*
+   * Pops the top of the heap, it must not be empty.
+   * Must be called with m_ConsumerMutex held.
+   */
+  TData PopTop() {
+    std::pop_heap(m_vHeap.begin(), m_vHeap.end(), m_Compare);
+    TData Data = std::move(m_vHeap.back());
+    m_vHeap.pop_back();
+    return Data;
+  }
+
+public:
+  /*
+   * Enqueue one object, it's only appended to the insertion buffer.
+   */
+  void Push(TData &&Data) {
+    {
+      std::scoped_lock<std::mutex> lock(m_ProducerMutex);
+      m_vInsertion.push_back(std::move(Data));
+      m_nInserted.store(m_vInsertion.size(), std::memory_order_release);
+    }
+    ++m_nSize;
+  }
+
+  /*
+   * Enqueue several objects under a single lock.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    long nCount = static_cast<long>(vData.size());
+    {
+      std::scoped_lock<std::mutex> lock(m_ProducerMutex);
+      std::move(vData.begin(), vData.end(), std::back_inserter(m_vInsertion));
+      m_nInserted.store(m_vInsertion.size(), std::memory_order_release);
+    }
+    vData.clear();
+    m_nSize += nCount;
+  }
+
+  /*
+   * Merges the insertion buffer and dequeues the top object.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<std::mutex> lock(m_ConsumerMutex);
+    Merge();
+    if (m_vHeap.empty())
+      return false;
+
+    Data = PopTop();
+    --m_nSize;
+    return true;
+  }
+
+  /*
+   * Merges the insertion buffer once and dequeues up to nMax objects.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<std::mutex> lock(m_ConsumerMutex);
+    Merge();
+    size_t nCount = 0;
+    for (; nCount < nMax && !m_vHeap.empty(); ++nCount)
+      vData.push_back(PopTop());
+
+    m_nSize -= static_cast<long>(nCount);
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const { return static_cast<size_t>(std::max<long>(m_nSize.load(), 0)); }
+};
+
+#endif // INSERTION_BUFFER_QUEUE_NS_H
@@ -0,0 +1,127 @@
+#ifndef INSTRUMENT_NS_H
+#define INSTRUMENT_NS_H
+#ifdef INSTRUMENT_NS_H
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+#endif
+
+/*
+ * Hot path instrumentation, compiled in with THREADWRAPPER_INSTRUMENT (the ENABLE_INSTRUMENT
+ * CMake option). CDaemon then measures, around every Process call, the allocator calls and the
+ * voluntary and involuntary context switches of the processing thread, and adds them to its
+ * service statistics (CServiceStats::Instrumented). It costs two getrusage calls per message, so
+ * it's meant for test and profiling builds.
+ * The allocator calls are counted by the global operator new/delete that
+ * THREADWRAPPER_ALLOCATION_HOOKS defines: put it in exactly one translation unit of the program
+ * (it expands to nothing without THREADWRAPPER_INSTRUMENT). The context switches come from
+ * getrusage(RUSAGE_THREAD) on Linux, they stay at 0 elsewhere.
+ */
+
+/*
+ * Instrumentation counters.
+ */
+struct SInstrumentCounters {
+  std::uint64_t nMessages = 0;            // Messages measured.
+  std::uint64_t nAllocations = 0;         // operator new calls.
+  std::uint64_t nDeallocations = 0;       // operator delete calls.
+  std::uint64_t nVoluntarySwitches = 0;   // The thread blocked (futex, I/O, sleep...).
+  std::uint64_t nInvoluntarySwitches = 0; // The thread was preempted.
+
+  SInstrumentCounters &operator+=(const SInstrumentCounters &Other) {
+    nMessages += Other.nMessages;
+    nAllocations += Other.nAllocations;
+    nDeallocations += Other.nDeallocations;
+    nVoluntarySwitches += Other.nVoluntarySwitches;
+    nInvoluntarySwitches += Other.nInvoluntarySwitches;
+    return *this;
+  }
+
+  SInstrumentCounters operator-(const SInstrumentCounters &Other) const {
+    SInstrumentCounters sDelta;
+    sDelta.nMessages = nMessages - Other.nMessages;
+    sDelta.nAllocations = nAllocations - Other.nAllocations;
+    sDelta.nDeallocations = nDeallocations - Other.nDeallocations;
+    sDelta.nVoluntarySwitches = nVoluntarySwitches - Other.nVoluntarySwitches;
+    sDelta.nInvoluntarySwitches = nInvoluntarySwitches - Other.nInvoluntarySwitches;
+    return sDelta;
+  }
+};
+
+/*
+ * Per thread counters, fed by the allocation hooks.
+ */
+class CInstrument {
+private:
+  static inline thread_local std::uint64_t tl_nAllocations = 0;   // operator new calls.
+  static inline thread_local std::uint64_t tl_nDeallocations = 0; // operator delete calls.
+
+public:
+#ifdef THREADWRAPPER_INSTRUMENT
+  static constexpr bool kEnabled = true; // Is this an instrumentation build?
+#else
+  static constexpr bool kEnabled = false; // Is this an instrumentation build?
+#endif
+
+  /*
+   * Allocation hooks, called by THREADWRAPPER_ALLOCATION_HOOKS.
+   */
+  static void OnAllocate() { ++tl_nAllocations; }
+  static void OnDeallocate() { ++tl_nDeallocations; }
+
+  /*
+   * Counters of the calling thread since it started (nMessages is 0).
+   */
+  static SInstrumentCounters Thread() {
+    SInstrumentCounters sCounters;
+    sCounters.nAllocations = tl_nAllocations;
+    sCounters.nDeallocations = tl_nDeallocations;
+#if defined(__linux__) && defined(RUSAGE_THREAD)
+    rusage sUsage;
+    if (getrusage(RUSAGE_THREAD, &sUsage) == 0) {
+      sCounters.nVoluntarySwitches = static_cast<std::uint64_t>(sUsage.ru_nvcsw);
+      sCounters.nInvoluntarySwitches = static_cast<std::uint64_t>(sUsage.ru_nivcsw);
+    }
+#endif
+    return sCounters;
+  }
+};
+
+#ifdef THREADWRAPPER_INSTRUMENT
+// GCC can't tell the replaced operator new allocates with malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#define THREADWRAPPER_HOOKS_PUSH                                                                   \
+  _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmismatched-new-delete\"")
+#define THREADWRAPPER_HOOKS_POP _Pragma("GCC diagnostic pop")
+#else
+#define THREADWRAPPER_HOOKS_PUSH
+#define THREADWRAPPER_HOOKS_POP
+#endif
+
+/*
+ * Counting global operator new/delete (the array forms go through them), malloc based.
+ */
+#define THREADWRAPPER_ALLOCATION_HOOKS                                                             \
+  void *operator new(std::size_t nSize) {                                                          \
+    CInstrument::OnAllocate();                                                                     \
+    if (void *p = std::malloc(nSize > 0 ? nSize : 1))                                              \
+      return p;                                                                                    \
+    throw std::bad_alloc();                                                                        \
+  }                                                                                                \
+  THREADWRAPPER_HOOKS_PUSH                                                                         \
+  void operator delete(void *p) noexcept {                                                         \
+    if (p != nullptr)                                                                              \
+      CInstrument::OnDeallocate();                                                                 \
+    std::free(p);                                                                                  \
+  }                                                                                                \
+  void operator delete(void *p, std::size_t) noexcept { operator delete(p); }                      \
+  THREADWRAPPER_HOOKS_POP
+#else
+#define THREADWRAPPER_ALLOCATION_HOOKS
+#endif
+
+#endif // INSTRUMENT_NS_H
@@ -0,0 +1,254 @@
+#ifndef MULTI_QUEUE_NS_H
+#define MULTI_QUEUE_NS_H
+#ifdef MULTI_QUEUE_NS_H
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/*
+ * Relaxed priority queue engine for CDaemon (see HeapQueue.cc for the engine interface).
+ * MultiQueue: c x N heaps (N = consumer threads), each one with its own lock.
+ * Push goes to a random heap, pop looks at the top of two random heaps and takes the best one.
+ * Consumers rarely touch the same heap, so it scales with the number of consumers, but the order
+ * is only approximately the priority order. The quality of the order is measured as the rank
+ * error (how many queued messages were better than the one dequeued), see GetRankError.
+ * Usage: CDaemon<T, CMultiQueue> with SetConsumerThreads(N).
+ */
+template <class TData, class TCompare> class CMultiQueue {
+public:
+  /*
+   * Rank error measurement.
+   */
+  struct SRankError {
+    size_t nSamples; // How many pops were measured.
+    double fMean;    // Mean rank error.
+    size_t nMax;     // Worst rank error.
+  };
+
+private:
+  /*
+   * One heap.
+   */
+  struct alignas(64) SHeap {
+    std::mutex Mutex;         // Heap lock.
+    std::vector<TData> vHeap; // Heap storage.
+  };
+
+  std::vector<std::unique_ptr<SHeap>> m_vHeaps; // Heaps.
+  TCompare m_Compare;                           // Ordering.
+  size_t m_nHeapsPerConsumer = 2;               // c.
+  std::atomic<long> m_nSize = 0;                // Queued objects.
+  size_t m_nRankSampling = 1024;                // Measure the rank error once every n pops.
+  std::atomic<size_t> m_nPops = 0;              // Pop counter, to sample the rank error.
+  std::atomic<size_t> m_nRankSamples = 0;       // Rank error samples.
+  std::atomic<size_t> m_nRankErrorSum = 0;      // Sum of the sampled rank errors.
+  std::atomic<size_t> m_nRankErrorMax = 0;      // Worst sampled rank error.
+
+  /*
+   * Thread local xorshift generator.
+   */
+  static size_t Random() {
+    static thread_local std::uint64_t nState =
+        std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+    nState ^= nState << 13;
+    nState ^= nState >> 7;
+    nState ^= nState << 17;
+    return static_cast<size_t>(nState);
+  }
+
+  /*
+   * Pops the top of a heap, it must be locked and not empty.
+   */
+  void PopFrom(SHeap &Heap, TData &Data) {
+    std::pop_heap(Heap.vHeap.begin(), Heap.vHeap.end(), m_Compare);
+    Data = std::move(Heap.vHeap.back());
+    Heap.vHeap.pop_back();
+    --m_nSize;
+  }
+
+  /*
+   * Counts how many queued objects should have been dequeued before Data.
+   * The heaps are locked one at a time, so the measurement is a snapshot per heap.
+   */
+  void SampleRankError(const TData &Data) {
+    size_t nRank = 0;
+    for (auto &pHeap : m_vHeaps) {
+      std::scoped_lock<std::mutex> lock(pHeap->Mutex);
+      nRank += static_cast<size_t>(std::count_if(pHeap->vHeap.begin(), pHeap->vHeap.end(),
+                                                 [&](const TData &Other) {
+                                                   return m_Compare(Data, Other);
+                                                 }));
+    }
+
+    ++m_nRankSamples;
+    m_nRankErrorSum += nRank;
+    size_t nMax = m_nRankErrorMax.load();
+    while (nRank > nMax && !m_nRankErrorMax.compare_exchange_weak(nMax, nRank)) {
+    }
+  }
+
+  /*
+   * Pops with the two random choices, falls back to a scan of every heap.
+   */
+  bool PopAny(TData &Data) {
+    size_t nHeaps = m_vHeaps.size();
+    for (int nTry = 0; nTry < 4; ++nTry) {
+      SHeap *pFirst = m_vHeaps[Random() % nHeaps].get();
+      SHeap *pSecond = m_vHeaps[Random() % nHeaps].get();
+
+      std::unique_lock<std::mutex> lockFirst(pFirst->Mutex, std::try_to_lock);
+      if (!lockFirst.owns_lock())
+        continue;
+      std::unique_lock<std::mutex> lockSecond;
+      if (pSecond != pFirst)
+        lockSecond = std::unique_lock<std::mutex>(pSecond->Mutex, std::try_to_lock);
+      if (!lockSecond.owns_lock() || pSecond->vHeap.empty())
+        pSecond = pFirst;
+
+      SHeap *pBest = pFirst;
+      if (pFirst->vHeap.empty() ||
+          (!pSecond->vHeap.empty() && m_Compare(pFirst->vHeap.front(), pSecond->vHeap.front())))
+        pBest = pSecond;
+
+      if (!pBest->vHeap.empty()) {
+        PopFrom(*pBest, Data);
+        return true;
+      }
+    }
+
+    // Unlucky (or almost empty), look everywhere.
+    size_t nStart = Random();
+    for (size_t i = 0; i < nHeaps; ++i) {
+      SHeap &Heap = *m_vHeaps[(nStart + i) % nHeaps];
+      std::scoped_lock<std::mutex> lock(Heap.Mutex);
+      if (!Heap.vHeap.empty()) {
+        PopFrom(Heap, Data);
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  /*
+   * Rebuilds the heaps, moving the queued objects.
+   * Not thread safe.
+   */
+  void Resize(size_t nHeaps) {
+    std::vector<TData> vAll;
+    for (auto &pHeap : m_vHeaps)
+      std::move(pHeap->vHeap.begin(), pHeap->vHeap.end(), std::back_inserter(vAll));
+
+    m_vHeaps.clear();
+    for (size_t i = 0; i < std::max<size_t>(nHeaps, 1); ++i)
+      m_vHeaps.push_back(std::make_unique<SHeap>());
+
+    m_nSize = 0;
+    for (TData &Data : vAll)
+      Push(std::move(Data));
+  }
+
+public:
+  /*
+   * Constructor, sized for a single consumer until SetConsumers is called.
+   */
+  CMultiQueue() { Resize(m_nHeapsPerConsumer); }
+
+  /*
+   * Number of heaps per consumer thread (c), the default is 2.
+   * Not thread safe, call it before the daemon starts.
+   */
+  void SetHeapsPerConsumer(size_t nHeapsPerConsumer) {
+    size_t nConsumers = m_vHeaps.size() / m_nHeapsPerConsumer;
+    m_nHeapsPerConsumer = std::max<size_t>(nHeapsPerConsumer, 1);
+    Resize(m_nHeapsPerConsumer * nConsumers);
+  }
+
+  /*
+   * Number of consumer threads (N), CDaemon calls it from SetConsumerThreads.
+   * Not thread safe, call it before the daemon starts.
+   */
+  void SetConsumers(size_t nConsumers) {
+    Resize(m_nHeapsPerConsumer * std::max<size_t>(nConsumers, 1));
+  }
+
+  /*
+   * Measure the rank error once every nPops pops, 0 disables the measurement.
+   * Each measurement walks all the queued objects.
+   */
+  void SetRankErrorSampling(size_t nPops) { m_nRankSampling = nPops; }
+
+  /*
+   * Rank error measured so far.
+   */
+  SRankError GetRankError() const {
+    size_t nSamples = m_nRankSamples.load();
+    return SRankError{nSamples, nSamples ? double(m_nRankErrorSum.load()) / double(nSamples) : 0.0,
+                      m_nRankErrorMax.load()};
+  }
+
+  /*
+   * Enqueue one object in a random heap.
+   */
+  void Push(TData &&Data) {
+    size_t nHeaps = m_vHeaps.size();
+    for (;;) {
+      SHeap &Heap = *m_vHeaps[Random() % nHeaps];
+      std::unique_lock<std::mutex> lock(Heap.Mutex, std::try_to_lock);
+      if (lock.owns_lock()) {
+        Heap.vHeap.push_back(std::move(Data));
+        std::push_heap(Heap.vHeap.begin(), Heap.vHeap.end(), m_Compare);
+        ++m_nSize;
+        return;
+      }
+    }
+  }
+
+  /*
+   * Enqueue several objects.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    for (TData &Data : vData)
+      Push(std::move(Data));
+    vData.clear();
+  }
+
+  /*
+   * Dequeue one of the top objects.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    if (m_nSize.load() <= 0 || !PopAny(Data))
+      return false;
+
+    if (m_nRankSampling > 0 && ++m_nPops % m_nRankSampling == 0)
+      SampleRankError(Data);
+    return true;
+  }
+
+  /*
+   * Dequeue up to nMax objects, each one with its own two random choices.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    size_t nCount = 0;
+    TData Data;
+    for (; nCount < nMax && TryPop(Data); ++nCount)
+      vData.push_back(std::move(Data));
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const { return static_cast<size_t>(std::max<long>(m_nSize.load(), 0)); }
+};
+
+#endif // MULTI_QUEUE_NS_H
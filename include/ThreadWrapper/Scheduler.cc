@@ -0,0 +1,160 @@
+#ifndef SCHEDULER_NS_H
+#define SCHEDULER_NS_H
+#ifdef SCHEDULER_NS_H
+#include <type_traits>
+#include <utility>
+#endif
+
+/*
+ * Sender/receiver (P2300, std::execution) shaped scheduler for CDaemon, see CDaemon::GetScheduler.
+ * It's a local C++17 API with the P2300R10 member names: scheduler.schedule() returns a sender,
+ * sender.connect(receiver) returns an operation state and operation.start() enqueues it in the
+ * daemon queue. The daemon thread then completes the receiver with set_value(), or with
+ * set_stopped() if the daemon stops before getting to it (EStopMode::Abort or
+ * EStopMode::DrainUntilDeadline).
+ * The operation state is the queued message itself (it's linked from SData::pTask), so hopping
+ * onto a daemon doesn't allocate.
+ * The message priority is the scheduler one (WithPriority), unless the receiver environment
+ * answers the get_priority query: receiver.get_env().query(get_priority).
+ * It doesn't interoperate with a std::execution (or stdexec) library as is: there are no concept
+ * tags (sender_concept, operation_state_concept, scheduler_concept), no completion_signatures and
+ * no get_env, and the completion scheduler is the GetCompletionScheduler member instead of the
+ * get_completion_scheduler query. Drive it directly, or wrap it in an adapter of that library.
+ */
+
+/*
+ * Work item queued by a scheduler operation, run by the daemon instead of Process.
+ */
+class CScheduledTask {
+public:
+  /*
+   * Runs on the daemon thread.
+   */
+  virtual void Run() noexcept = 0;
+
+  /*
+   * The daemon stopped without running it.
+   */
+  virtual void Cancel() noexcept = 0;
+
+protected:
+  ~CScheduledTask() = default;
+};
+
+/*
+ * Priority query tag, a receiver environment may answer it to pick the message priority.
+ */
+struct SGetPriority {};
+inline constexpr SGetPriority get_priority{};
+
+/*
+ * Does the receiver environment answer the priority query?
+ */
+template <class TReceiver, class = void> struct SReceiverHasPriority : std::false_type {};
+template <class TReceiver>
+struct SReceiverHasPriority<
+    TReceiver,
+    std::void_t<decltype(int(std::declval<const TReceiver &>().get_env().query(get_priority)))>>
+    : std::true_type {};
+
+/*
+ * Scheduler of a daemon: the work scheduled on it runs on the daemon thread, in priority order
+ * with the daemon messages.
+ */
+template <class TDaemon> class CDaemonScheduler {
+private:
+  TDaemon *m_pDaemon; // Daemon running the work.
+  int m_nPriority;    // Priority of the work.
+
+public:
+  /*
+   * Operation state, the queued work item.
+   */
+  template <class TReceiver> class COperation final : public CScheduledTask {
+  private:
+    TDaemon *m_pDaemon;   // Daemon running the work.
+    int m_nPriority;      // Priority of the work.
+    TReceiver m_Receiver; // Receiver to complete.
+
+  public:
+    COperation(TDaemon *pDaemon, int nPriority, TReceiver Receiver)
+        : m_pDaemon(pDaemon), m_nPriority(nPriority), m_Receiver(std::move(Receiver)) {}
+
+    COperation(const COperation &) = delete;
+    COperation &operator=(const COperation &) = delete;
+
+    /*
+     * Enqueues the operation in the daemon queue.
+     * The operation must stay alive (and in place) until the receiver is completed.
+     */
+    void start() noexcept {
+      int nPriority = m_nPriority;
+      if constexpr (SReceiverHasPriority<TReceiver>::value)
+        nPriority = int(m_Receiver.get_env().query(get_priority));
+      m_pDaemon->SafeAddTask(*this, nPriority);
+    }
+
+    void Run() noexcept override { std::move(m_Receiver).set_value(); }
+    void Cancel() noexcept override { std::move(m_Receiver).set_stopped(); }
+  };
+
+  /*
+   * Sender returned by schedule().
+   */
+  class CSender {
+  private:
+    TDaemon *m_pDaemon; // Daemon running the work.
+    int m_nPriority;    // Priority of the work.
+
+  public:
+    CSender(TDaemon *pDaemon, int nPriority) : m_pDaemon(pDaemon), m_nPriority(nPriority) {}
+
+    /*
+     * Connects a receiver, the operation state is returned by value (no allocation).
+     */
+    template <class TReceiver>
+    COperation<std::decay_t<TReceiver>> connect(TReceiver &&Receiver) const {
+      return COperation<std::decay_t<TReceiver>>(m_pDaemon, m_nPriority,
+                                                 std::forward<TReceiver>(Receiver));
+    }
+
+    /*
+     * Scheduler the sender completes on (what the P2300 get_completion_scheduler query answers).
+     */
+    CDaemonScheduler GetCompletionScheduler() const {
+      return CDaemonScheduler(*m_pDaemon, m_nPriority);
+    }
+  };
+
+  /*
+   * Constructor.
+   * @param Daemon The daemon running the work.
+   * @param nPriority Priority of the work.
+   */
+  explicit CDaemonScheduler(TDaemon &Daemon, int nPriority = 0)
+      : m_pDaemon(&Daemon), m_nPriority(nPriority) {}
+
+  /*
+   * Sender completing on the daemon thread.
+   */
+  CSender schedule() const { return CSender(m_pDaemon, m_nPriority); }
+
+  /*
+   * Same daemon, another priority.
+   */
+  CDaemonScheduler WithPriority(int nPriority) const {
+    return CDaemonScheduler(*m_pDaemon, nPriority);
+  }
+
+  /*
+   * Priority of the work scheduled on it.
+   */
+  int Priority() const { return m_nPriority; }
+
+  bool operator==(const CDaemonScheduler &Other) const {
+    return m_pDaemon == Other.m_pDaemon && m_nPriority == Other.m_nPriority;
+  }
+  bool operator!=(const CDaemonScheduler &Other) const { return !(*this == Other); }
+};
+
+#endif // SCHEDULER_NS_H
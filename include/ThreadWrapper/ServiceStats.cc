@@ -0,0 +1,288 @@
+#ifndef SERVICE_STATS_NS_H
+#define SERVICE_STATS_NS_H
+#ifdef SERVICE_STATS_NS_H
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+
+#include <ThreadWrapper/Instrument.cc>
+#endif
+
+/*
+ * Online service time and arrival rate estimates, per priority (see CDaemon::SetServiceStats).
+ * The priorities are grouped in kBuckets buckets, a priority outside [0, kBuckets) shares the
+ * bucket at the edge. Each bucket keeps:
+ * - The service time, an exponentially decayed average of the Process durations;
+ * - The arrival rate, decayed over kRateTimeConstant and refreshed every kRefreshPeriod;
+ * - How many messages are queued (arrived minus departed);
+ * - The observed queueing delay, an exponentially decayed average (needs a clock policy);
+ * - How many messages the admission control rejected (see CDaemon::SetLatencySLO).
+ * The instrumentation build also accumulates the allocator calls and context switches of the
+ * Process calls, all priorities together (see Instrument.cc).
+ * ExpectedWait combines them: the work queued ahead of a new message (same or higher priority),
+ * stretched by the load of the higher priorities that will keep arriving while it waits.
+ */
+class CServiceStats {
+public:
+  static constexpr bool kEnabled = true; // Stats policy flag (see CNoStats).
+  static constexpr int kBuckets = 32;    // Priority buckets.
+
+private:
+  /*
+   * Per priority counters, one cache line each.
+   */
+  struct alignas(64) SBucket {
+    std::atomic<unsigned long> nArrived{0}; // Messages enqueued.
+    std::atomic<long> nDeparted{0};         // Messages dequeued.
+    std::atomic<double> fServiceSec{0.0};   // Service time estimate (s), 0 until measured.
+    std::atomic<double> fArrivalRate{0.0};  // Arrival rate estimate (messages/s).
+    std::atomic<double> fLoadAbove{0.0};    // Load of the higher priority buckets.
+    std::atomic<double> fDelaySec{0.0};     // Observed queueing delay (s).
+    std::atomic<size_t> nRejected{0};       // Messages rejected by the admission control.
+    unsigned long nLastArrived = 0;         // nArrived at the last refresh.
+  };
+
+  static constexpr double kDecay = 0.125; // Weight of a new service time sample.
+  static constexpr std::chrono::milliseconds kRefreshPeriod{10};     // Arrival rate refresh.
+  static constexpr std::chrono::milliseconds kRateTimeConstant{100}; // Arrival rate decay.
+
+  std::array<SBucket, kBuckets> m_aBuckets;                   // Buckets, by priority.
+  std::atomic<double> m_fServiceSec{0.0};                     // All priorities service time.
+  std::atomic<std::chrono::steady_clock::rep> m_nLastRefresh; // Last refresh (steady_clock).
+  std::mutex m_RefreshMutex;                                  // Only one thread refreshes.
+  std::atomic<std::uint64_t> m_nInstrumented{0};              // Instrumented messages.
+  std::atomic<std::uint64_t> m_nAllocations{0};               // Their operator new calls.
+  std::atomic<std::uint64_t> m_nDeallocations{0};             // Their operator delete calls.
+  std::atomic<std::uint64_t> m_nVoluntarySwitches{0};         // Their voluntary switches.
+  std::atomic<std::uint64_t> m_nInvoluntarySwitches{0};       // Their involuntary switches.
+
+  /*
+   * Adds a sample to a decayed average.
+   */
+  static void Decay(std::atomic<double> &fAverage, double fSample, double fWeight) {
+    double fOld = fAverage.load(std::memory_order_relaxed);
+    double fNew;
+    do {
+      fNew = fOld > 0.0 ? fOld + fWeight * (fSample - fOld) : fSample;
+    } while (!fAverage.compare_exchange_weak(fOld, fNew, std::memory_order_relaxed));
+  }
+
+  /*
+   * Service time of a bucket, the all priorities one until the bucket has its own measurement.
+   */
+  double BucketServiceTime(const SBucket &Bucket) const {
+    double fServiceSec = Bucket.fServiceSec.load(std::memory_order_relaxed);
+    return fServiceSec > 0.0 ? fServiceSec : m_fServiceSec.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Refreshes the arrival rates and the higher priority loads, at most once per kRefreshPeriod.
+   */
+  void Refresh(std::chrono::steady_clock::time_point dtNow) {
+    auto nNow = dtNow.time_since_epoch().count();
+    auto nLast = m_nLastRefresh.load(std::memory_order_relaxed);
+    auto nPeriod =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(kRefreshPeriod).count();
+    if (nNow - nLast < nPeriod)
+      return;
+
+    std::unique_lock<std::mutex> lock(m_RefreshMutex, std::try_to_lock);
+    if (!lock.owns_lock())
+      return; // Someone else is refreshing
+    nLast = m_nLastRefresh.load(std::memory_order_relaxed);
+    if (nNow - nLast < nPeriod)
+      return;
+
+    double fElapsedSec =
+        std::chrono::duration<double>(std::chrono::steady_clock::duration(nNow - nLast)).count();
+    double fWeight =
+        1.0 - std::exp(-fElapsedSec / std::chrono::duration<double>(kRateTimeConstant).count());
+
+    double fLoad = 0.0;
+    for (SBucket &Bucket : m_aBuckets) {
+      unsigned long nArrived = Bucket.nArrived.load(std::memory_order_relaxed);
+      double fRate = static_cast<double>(nArrived - Bucket.nLastArrived) / fElapsedSec;
+      Bucket.nLastArrived = nArrived;
+
+      double fOldRate = Bucket.fArrivalRate.load(std::memory_order_relaxed);
+      fRate = fOldRate + fWeight * (fRate - fOldRate);
+      Bucket.fArrivalRate.store(fRate, std::memory_order_relaxed);
+
+      Bucket.fLoadAbove.store(fLoad, std::memory_order_relaxed);
+      fLoad += fRate * BucketServiceTime(Bucket);
+    }
+    m_nLastRefresh.store(nNow, std::memory_order_relaxed);
+  }
+
+public:
+  /*
+   * Constructor, the first arrival rate window starts now.
+   */
+  CServiceStats() : m_nLastRefresh(std::chrono::steady_clock::now().time_since_epoch().count()) {}
+
+  CServiceStats(const CServiceStats &) = delete;
+  CServiceStats &operator=(const CServiceStats &) = delete;
+
+  /*
+   * Bucket of a priority.
+   */
+  static int Bucket(int nPriority) { return std::clamp(nPriority, 0, kBuckets - 1); }
+
+  /*
+   * A message was enqueued.
+   */
+  void OnArrival(int nPriority) {
+    m_aBuckets[Bucket(nPriority)].nArrived.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /*
+   * A message was dequeued.
+   */
+  void OnDeparture(int nPriority) {
+    m_aBuckets[Bucket(nPriority)].nDeparted.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /*
+   * A message waited fDelaySec in the queue.
+   */
+  void OnDelay(int nPriority, double fDelaySec) {
+    Decay(m_aBuckets[Bucket(nPriority)].fDelaySec, fDelaySec, kDecay);
+  }
+
+  /*
+   * A message was rejected by the admission control.
+   */
+  void OnRejected(int nPriority) {
+    m_aBuckets[Bucket(nPriority)].nRejected.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /*
+   * A message was processed.
+   * @param nPriority Message priority.
+   * @param Elapsed How long Process took.
+   * @param dtNow Current time.
+   */
+  void OnServiced(int nPriority, std::chrono::nanoseconds Elapsed,
+                  std::chrono::steady_clock::time_point dtNow) {
+    double fSec = std::chrono::duration<double>(Elapsed).count();
+    Decay(m_aBuckets[Bucket(nPriority)].fServiceSec, fSec, kDecay);
+    Decay(m_fServiceSec, fSec, kDecay);
+    Refresh(dtNow);
+  }
+
+  /*
+   * A message was processed in the instrumentation build.
+   * @param sDelta What its Process call cost (nMessages is ignored).
+   */
+  void OnInstrumented(const SInstrumentCounters &sDelta) {
+    m_nInstrumented.fetch_add(1, std::memory_order_relaxed);
+    m_nAllocations.fetch_add(sDelta.nAllocations, std::memory_order_relaxed);
+    m_nDeallocations.fetch_add(sDelta.nDeallocations, std::memory_order_relaxed);
+    m_nVoluntarySwitches.fetch_add(sDelta.nVoluntarySwitches, std::memory_order_relaxed);
+    m_nInvoluntarySwitches.fetch_add(sDelta.nInvoluntarySwitches, std::memory_order_relaxed);
+  }
+
+  /*
+   * Expected wait of a message enqueued now (seconds).
+   * Constant time: the work ahead is summed over the (fixed number of) higher priority buckets.
+   * @param nPriority Priority of the new message.
+   * @param nConsumers Threads consuming the queue.
+   * @return The estimate, infinity if the higher priorities alone saturate the consumers.
+   */
+  double ExpectedWait(int nPriority, int nConsumers) {
+    Refresh(std::chrono::steady_clock::now());
+
+    int nBucket = Bucket(nPriority);
+    double fWork = 0.0;
+    for (int i = 0; i <= nBucket; ++i)
+      fWork += static_cast<double>(Queued(i)) * BucketServiceTime(m_aBuckets[i]);
+
+    double fConsumers = std::max(nConsumers, 1);
+    double fLoadAbove = m_aBuckets[nBucket].fLoadAbove.load(std::memory_order_relaxed) / fConsumers;
+    if (fLoadAbove >= 1.0)
+      return std::numeric_limits<double>::infinity();
+    return fWork / fConsumers / (1.0 - fLoadAbove);
+  }
+
+  /*
+   * Service time estimate of a priority (seconds).
+   */
+  double ServiceTime(int nPriority) const {
+    return BucketServiceTime(m_aBuckets[Bucket(nPriority)]);
+  }
+
+  /*
+   * Arrival rate estimate of a priority (messages per second).
+   */
+  double ArrivalRate(int nPriority) const {
+    return m_aBuckets[Bucket(nPriority)].fArrivalRate.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Observed queueing delay of a priority (seconds), 0 until measured.
+   */
+  double ObservedDelay(int nPriority) const {
+    return m_aBuckets[Bucket(nPriority)].fDelaySec.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * How many messages of a priority were rejected by the admission control.
+   */
+  size_t Rejected(int nPriority) const {
+    return m_aBuckets[Bucket(nPriority)].nRejected.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Instrumentation counters, totals over the processed messages (divide by nMessages for the
+   * per message cost). All 0 unless built with THREADWRAPPER_INSTRUMENT.
+   */
+  SInstrumentCounters Instrumented() const {
+    SInstrumentCounters sCounters;
+    sCounters.nMessages = m_nInstrumented.load(std::memory_order_relaxed);
+    sCounters.nAllocations = m_nAllocations.load(std::memory_order_relaxed);
+    sCounters.nDeallocations = m_nDeallocations.load(std::memory_order_relaxed);
+    sCounters.nVoluntarySwitches = m_nVoluntarySwitches.load(std::memory_order_relaxed);
+    sCounters.nInvoluntarySwitches = m_nInvoluntarySwitches.load(std::memory_order_relaxed);
+    return sCounters;
+  }
+
+  /*
+   * How many messages of a priority are queued.
+   */
+  long Queued(int nPriority) const {
+    const SBucket &Bucket = m_aBuckets[CServiceStats::Bucket(nPriority)];
+    long nQueued = static_cast<long>(Bucket.nArrived.load(std::memory_order_relaxed)) -
+                   Bucket.nDeparted.load(std::memory_order_relaxed);
+    return std::max<long>(nQueued, 0);
+  }
+};
+
+/*
+ * Stats policy that compiles the service statistics out (see SDaemonPolicy): every member is an
+ * empty inline function, CDaemon never calls them (kEnabled is false) and the queries return 0.
+ */
+class CNoStats {
+public:
+  static constexpr bool kEnabled = false; // Stats policy flag.
+
+  void OnArrival(int) {}
+  void OnDeparture(int) {}
+  void OnDelay(int, double) {}
+  void OnRejected(int) {}
+  void OnServiced(int, std::chrono::nanoseconds, std::chrono::steady_clock::time_point) {}
+  void OnInstrumented(const SInstrumentCounters &) {}
+  double ExpectedWait(int, int) { return 0.0; }
+  double ServiceTime(int) const { return 0.0; }
+  double ArrivalRate(int) const { return 0.0; }
+  double ObservedDelay(int) const { return 0.0; }
+  size_t Rejected(int) const { return 0; }
+  SInstrumentCounters Instrumented() const { return {}; }
+  long Queued(int) const { return 0; }
+};
+
+#endif // SERVICE_STATS_NS_H
@@ -0,0 +1,85 @@
+#ifndef SPIN_LOCK_NS_H
+#define SPIN_LOCK_NS_H
+#ifdef SPIN_LOCK_NS_H
+#include <atomic>
+#include <thread>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define THREADWRAPPER_HAS_PAUSE 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THREADWRAPPER_HAS_PAUSE 1
+#endif
+#endif
+
+/*
+ * CPU hint for spin loops (pause on x86, yield on ARM).
+ */
+inline void CpuRelax() {
+#ifdef THREADWRAPPER_HAS_PAUSE
+  _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield");
+#endif
+}
+
+/*
+ * CPU hint: the cache line holding p will be read soon (see CDaemon::SetPrefetchDistance).
+ */
+inline void PrefetchRead(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(p, 0, 3);
+#elif defined(THREADWRAPPER_HAS_PAUSE)
+  _mm_prefetch(static_cast<const char *>(p), _MM_HINT_T0);
+#else
+  (void)p;
+#endif
+}
+
+/*
+ * Test and test-and-set spin lock, a drop in replacement for std::mutex (BasicLockable and
+ * Lockable) for very short critical sections, like the queue engines ones.
+ * Use it when the lock holder is never preempted for long (a thread per core): a waiter burns
+ * its core instead of sleeping.
+ */
+class CSpinLock {
+private:
+  static constexpr int kSpinsBeforeYield = 64; // Pause instructions before yielding.
+
+  std::atomic<bool> m_bLocked = false; // Is it locked?
+
+public:
+  CSpinLock() = default;
+  CSpinLock(const CSpinLock &) = delete;
+  CSpinLock &operator=(const CSpinLock &) = delete;
+
+  /*
+   * Locks, spinning on a plain load (no cache line ping-pong) while it's taken.
+   */
+  void lock() {
+    for (int nSpins = 0; m_bLocked.exchange(true, std::memory_order_acquire);) {
+      while (m_bLocked.load(std::memory_order_relaxed)) {
+        if (++nSpins < kSpinsBeforeYield)
+          CpuRelax();
+        else
+          std::this_thread::yield();
+      }
+    }
+  }
+
+  /*
+   * Locks if it's free.
+   * @return true if it was locked.
+   */
+  bool try_lock() {
+    return !m_bLocked.load(std::memory_order_relaxed) &&
+           !m_bLocked.exchange(true, std::memory_order_acquire);
+  }
+
+  /*
+   * Unlocks.
+   */
+  void unlock() { m_bLocked.store(false, std::memory_order_release); }
+};
+
+#endif // SPIN_LOCK_NS_H
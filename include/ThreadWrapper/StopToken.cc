@@ -0,0 +1,246 @@
+#ifndef STOP_TOKEN_NS_H
+#define STOP_TOKEN_NS_H
+#ifdef STOP_TOKEN_NS_H
+#if __has_include(<version>)
+#include <version>
+#endif
+#if defined(__cpp_lib_jthread)
+#include <stop_token>
+#else
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#endif
+#endif
+
+/*
+ * Cooperative cancellation: CStopSource, CStopToken and CStopCallback.
+ * They're std::stop_source, std::stop_token and std::stop_callback when the standard library has
+ * them (C++20), otherwise a C++17 implementation with the same interface:
+ * - CStopSource::request_stop() requests the stop once and runs the registered callbacks in the
+ *   requesting thread;
+ * - CStopToken::stop_requested() is a single atomic load;
+ * - A CStopCallback runs its callback when the stop is requested (or right away if it already
+ *   was) and its destructor waits for the callback to return if it's running in another thread
+ *   (the callback may destroy its own CStopCallback).
+ */
+#if defined(__cpp_lib_jthread)
+
+using CStopSource = std::stop_source;
+using CStopToken = std::stop_token;
+template <class TCallback> using CStopCallback = std::stop_callback<TCallback>;
+
+#else
+
+/*
+ * State shared by a stop source and its tokens and callbacks.
+ */
+class CStopState {
+public:
+  /*
+   * Registered callback, an intrusive doubly linked list node.
+   */
+  struct SCallbackNode {
+    SCallbackNode *pPrev = nullptr;    // Previous node.
+    SCallbackNode *pNext = nullptr;    // Next node.
+    void (*pInvoke)(void *) = nullptr; // Runs the callback.
+    void *pOwner = nullptr;            // Argument of pInvoke.
+    std::atomic<bool> bDone = false;   // Did the callback return (while requesting the stop)?
+    bool *pDestroyed = nullptr;        // Set by Unregister if the callback destroys its node.
+  };
+
+private:
+  std::atomic<bool> m_bRequested = false; // Was the stop requested?
+  SCallbackNode *m_pHead = nullptr;       // Registered callbacks.
+  SCallbackNode *m_pRunning = nullptr;    // Callback being run by request_stop.
+  std::thread::id m_RequestingThread;     // Thread running request_stop.
+  std::mutex m_Mutex;                     // Protects the list.
+
+  /*
+   * Unlinks a node, must be called with m_Mutex held.
+   */
+  void Unlink(SCallbackNode *pNode) {
+    if (pNode->pPrev != nullptr)
+      pNode->pPrev->pNext = pNode->pNext;
+    else
+      m_pHead = pNode->pNext;
+    if (pNode->pNext != nullptr)
+      pNode->pNext->pPrev = pNode->pPrev;
+    pNode->pPrev = pNode->pNext = nullptr;
+  }
+
+public:
+  /*
+   * Was the stop requested?
+   */
+  bool Requested() const { return m_bRequested.load(std::memory_order_acquire); }
+
+  /*
+   * Requests the stop and runs the callbacks.
+   * @return false if it was already requested.
+   */
+  bool Request() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    if (m_bRequested.exchange(true, std::memory_order_acq_rel))
+      return false;
+
+    m_RequestingThread = std::this_thread::get_id();
+    while (m_pHead != nullptr) {
+      SCallbackNode *pNode = m_pHead;
+      bool bDestroyed = false;
+      Unlink(pNode);
+      pNode->pDestroyed = &bDestroyed;
+      m_pRunning = pNode;
+      lock.unlock();
+      pNode->pInvoke(pNode->pOwner);
+      lock.lock();
+      m_pRunning = nullptr;
+      if (bDestroyed)
+        continue; // The node is gone
+      pNode->pDestroyed = nullptr;
+      pNode->bDone.store(true, std::memory_order_release);
+    }
+    return true;
+  }
+
+  /*
+   * Registers a callback.
+   * @return false if the stop was already requested (the callback isn't registered).
+   */
+  bool Register(SCallbackNode *pNode) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    if (m_bRequested.load(std::memory_order_acquire))
+      return false;
+
+    pNode->pNext = m_pHead;
+    if (m_pHead != nullptr)
+      m_pHead->pPrev = pNode;
+    m_pHead = pNode;
+    return true;
+  }
+
+  /*
+   * Unregisters a callback, waiting for it to return if another thread is running it.
+   */
+  void Unregister(SCallbackNode *pNode) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      if (m_pRunning != pNode) {
+        if (!pNode->bDone.load(std::memory_order_acquire))
+          Unlink(pNode);
+        return;
+      }
+      if (m_RequestingThread == std::this_thread::get_id()) {
+        *pNode->pDestroyed = true; // Destroyed by its own callback, Request must not touch it
+        return;
+      }
+    }
+
+    while (!pNode->bDone.load(std::memory_order_acquire))
+      std::this_thread::yield();
+  }
+};
+
+/*
+ * Observes a stop request.
+ */
+class CStopToken {
+private:
+  std::shared_ptr<CStopState> m_pState; // Shared state, null for a token with no source.
+
+  friend class CStopSource;
+  template <class TCallback> friend class CStopCallback;
+
+  explicit CStopToken(std::shared_ptr<CStopState> pState) : m_pState(std::move(pState)) {}
+
+public:
+  CStopToken() = default;
+
+  /*
+   * Was the stop requested?
+   */
+  bool stop_requested() const { return m_pState != nullptr && m_pState->Requested(); }
+
+  /*
+   * Can the stop ever be requested?
+   */
+  bool stop_possible() const { return m_pState != nullptr; }
+};
+
+/*
+ * Requests the stop.
+ */
+class CStopSource {
+private:
+  std::shared_ptr<CStopState> m_pState; // Shared state.
+
+public:
+  CStopSource() : m_pState(std::make_shared<CStopState>()) {}
+
+  /*
+   * Requests the stop, the callbacks run in the calling thread.
+   * @return false if it was already requested.
+   */
+  bool request_stop() { return m_pState->Request(); }
+
+  /*
+   * Was the stop requested?
+   */
+  bool stop_requested() const { return m_pState->Requested(); }
+
+  /*
+   * Token observing this source.
+   */
+  CStopToken get_token() const { return CStopToken(m_pState); }
+};
+
+/*
+ * Runs a callback when the stop is requested.
+ */
+template <class TCallback> class CStopCallback {
+private:
+  CStopState::SCallbackNode m_Node;     // Registration.
+  std::shared_ptr<CStopState> m_pState; // Shared state, null if it isn't registered.
+  TCallback m_Callback;                 // Callback.
+
+  /*
+   * Runs the callback of a registered CStopCallback.
+   */
+  static void Invoke(void *pThis) { static_cast<CStopCallback *>(pThis)->m_Callback(); }
+
+public:
+  /*
+   * Registers the callback, or runs it right away if the stop was already requested.
+   */
+  template <class TInit>
+  explicit CStopCallback(const CStopToken &Token, TInit &&Callback)
+      : m_Callback(std::forward<TInit>(Callback)) {
+    m_Node.pInvoke = &CStopCallback::Invoke;
+    m_Node.pOwner = this;
+    if (Token.m_pState == nullptr)
+      return;
+    if (Token.m_pState->Register(&m_Node))
+      m_pState = Token.m_pState;
+    else
+      m_Callback(); // Already requested
+  }
+
+  CStopCallback(const CStopCallback &) = delete;
+  CStopCallback &operator=(const CStopCallback &) = delete;
+
+  /*
+   * Unregisters the callback, waits for it if it's running in another thread.
+   */
+  ~CStopCallback() {
+    if (m_pState != nullptr)
+      m_pState->Unregister(&m_Node);
+  }
+};
+
+template <class TCallback> CStopCallback(CStopToken, TCallback) -> CStopCallback<TCallback>;
+
+#endif // __cpp_lib_jthread
+
+#endif // STOP_TOKEN_NS_H
@@ -0,0 +1,127 @@
+#ifndef THREAD_POOL_NS_H
+#define THREAD_POOL_NS_H
+#ifdef THREAD_POOL_NS_H
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/*
+ * Pool of parked threads.
+ * Run hands a task to a parked thread (a new one is only created when none is parked), so daemons
+ * that are started and stopped often don't pay for the thread creation and teardown every time.
+ * The threads stay parked until the pool is destroyed (at exit for the shared pool), so the pool
+ * grows up to the highest number of tasks that ran at the same time.
+ */
+class CThreadPool {
+private:
+  std::vector<std::thread> m_vWorkers;           // Pool threads.
+  std::deque<std::packaged_task<void()>> m_Tasks; // Tasks waiting for a thread.
+  size_t m_nParked = 0;                          // Threads waiting for a task.
+  bool m_bShutdown = false;                      // Is the pool being destroyed?
+  mutable std::mutex m_Mutex;                    // Mutex.
+  std::condition_variable m_ConditionVar;        // Wakes the parked threads.
+
+  /*
+   * Pool thread loop.
+   */
+  void Worker() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    for (;;) {
+      ++m_nParked;
+      m_ConditionVar.wait(lock, [&] { return m_bShutdown || !m_Tasks.empty(); });
+      --m_nParked;
+      if (m_Tasks.empty())
+        return; // Shutdown
+
+      std::packaged_task<void()> Task = std::move(m_Tasks.front());
+      m_Tasks.pop_front();
+      lock.unlock();
+      Task();
+      lock.lock();
+    }
+  }
+
+  /*
+   * Creates a thread, must be called with m_Mutex held.
+   */
+  void Spawn() { m_vWorkers.emplace_back(&CThreadPool::Worker, this); }
+
+public:
+  CThreadPool() = default;
+  CThreadPool(const CThreadPool &) = delete;
+  CThreadPool &operator=(const CThreadPool &) = delete;
+
+  /*
+   * Destructor.
+   * The queued tasks are still run, then every thread is joined.
+   */
+  ~CThreadPool() {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      m_bShutdown = true;
+    }
+    m_ConditionVar.notify_all();
+
+    for (std::thread &Worker : m_vWorkers)
+      Worker.join();
+  }
+
+  /*
+   * Process wide pool, used by the daemons (see CDaemon::SetPooledThreads).
+   */
+  static CThreadPool &Shared() {
+    static CThreadPool sPool;
+    return sPool;
+  }
+
+  /*
+   * Makes sure at least nThreads threads exist, so the first Run calls don't create any.
+   */
+  void Reserve(size_t nThreads) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    while (m_vWorkers.size() < nThreads)
+      Spawn();
+  }
+
+  /*
+   * Runs a task in a pool thread.
+   * @param Task The task.
+   * @return A future that is ready when the task returns (it holds the task exception, if any).
+   */
+  std::future<void> Run(std::function<void()> Task) {
+    std::packaged_task<void()> PackagedTask(std::move(Task));
+    std::future<void> Future = PackagedTask.get_future();
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      m_Tasks.push_back(std::move(PackagedTask));
+      if (m_nParked < m_Tasks.size())
+        Spawn();
+    }
+    m_ConditionVar.notify_one();
+
+    return Future;
+  }
+
+  /*
+   * How many threads the pool has.
+   */
+  size_t Size() const {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    return m_vWorkers.size();
+  }
+
+  /*
+   * How many threads are parked.
+   */
+  size_t Parked() const {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    return m_nParked;
+  }
+};
+
+#endif // THREAD_POOL_NS_H
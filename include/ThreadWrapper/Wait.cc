@@ -0,0 +1,131 @@
+#ifndef WAIT_NS_H
+#define WAIT_NS_H
+#ifdef WAIT_NS_H
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <ThreadWrapper/SpinLock.cc>
+#endif
+
+/*
+ * Wait policies: how the consumer threads of CDaemon wait for work (see SDaemonPolicy).
+ * A wait policy provides:
+ * - bool WaitUntil(time_point dtWake, TPred Pred);  Waits until Pred() is true or dtWake
+ *                                                   (time_point::max() for no timeout).
+ *                                                   Returns Pred().
+ * - void NotifyOne();                               Something was enqueued, wake one waiter.
+ * - void NotifyAll();                               Several were enqueued, wake every waiter.
+ * - void NotifyAll(TUpdate Update);                 Runs Update (a state change the waiters must
+ *                                                   not miss) and wakes every waiter.
+ */
+
+/*
+ * Default wait policy, the threads sleep on a condition variable.
+ * The producers only take the mutex when a thread is (about to be) waiting. That's enough to not
+ * lose a notification: the thread increments m_nWaiting before checking the predicate and the
+ * producer updates the predicate state before checking m_nWaiting.
+ */
+class CConditionWait {
+private:
+  std::atomic<int> m_nWaiting = 0;        // Threads waiting on the conditional variable.
+  std::condition_variable m_ConditionVar; // Conditional variable.
+  std::mutex m_Mutex;                     // Mutex, protects the conditional variable.
+
+public:
+  /*
+   * Waits until Pred() is true or dtWake.
+   * @return Pred().
+   */
+  template <class TPred>
+  bool WaitUntil(std::chrono::steady_clock::time_point dtWake, TPred Pred) {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    ++m_nWaiting;
+    bool bRtn = true;
+    if (dtWake == std::chrono::steady_clock::time_point::max())
+      m_ConditionVar.wait(lock, Pred);
+    else
+      bRtn = m_ConditionVar.wait_until(lock, dtWake, Pred);
+    --m_nWaiting;
+    return bRtn;
+  }
+
+  /*
+   * Wakes one thread up, if one is waiting.
+   */
+  inline void NotifyOne() {
+    if (m_nWaiting.load() > 0) {
+      { std::scoped_lock<std::mutex> lock(m_Mutex); }
+      m_ConditionVar.notify_one();
+    }
+  }
+
+  /*
+   * Wakes every waiting thread up (the producer side of a bulk enqueue).
+   */
+  inline void NotifyAll() {
+    if (m_nWaiting.load() > 0) {
+      { std::scoped_lock<std::mutex> lock(m_Mutex); }
+      m_ConditionVar.notify_all();
+    }
+  }
+
+  /*
+   * Runs Update under the mutex and wakes every thread up.
+   */
+  template <class TUpdate> void NotifyAll(TUpdate Update) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      Update();
+    }
+    m_ConditionVar.notify_all();
+  }
+};
+
+/*
+ * Spin wait policy, the threads poll the predicate and never sleep (they yield the CPU after a
+ * while). The producers never lock nor notify. It trades a busy core per consumer thread for the
+ * lowest wake up latency.
+ */
+class CSpinWait {
+private:
+  static constexpr int kSpinsBeforeYield = 256; // Pause instructions before yielding.
+  static constexpr int kSpinsPerClockRead = 64; // Predicate checks per timeout check.
+
+public:
+  /*
+   * Polls Pred() until it's true or dtWake.
+   * @return Pred().
+   */
+  template <class TPred>
+  bool WaitUntil(std::chrono::steady_clock::time_point dtWake, TPred Pred) {
+    bool bTimeout = dtWake != std::chrono::steady_clock::time_point::max();
+    for (int nSpins = 0;; ++nSpins) {
+      if (Pred())
+        return true;
+      if (bTimeout && nSpins % kSpinsPerClockRead == 0 &&
+          std::chrono::steady_clock::now() >= dtWake)
+        return Pred();
+
+      if (nSpins < kSpinsBeforeYield)
+        CpuRelax();
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  /*
+   * Nothing to do, the waiters poll.
+   */
+  inline void NotifyOne() {}
+  inline void NotifyAll() {}
+
+  /*
+   * Runs Update, the waiters will see it on their next poll.
+   */
+  template <class TUpdate> void NotifyAll(TUpdate Update) { Update(); }
+};
+
+#endif // WAIT_NS_H
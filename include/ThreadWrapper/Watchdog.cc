@@ -0,0 +1,159 @@
+#ifndef WATCHDOG_NS_H
+#define WATCHDOG_NS_H
+#ifdef WATCHDOG_NS_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/*
+ * Stall watchdog, a single monitor thread shared by every daemon (see CDaemon::SetStallThreshold).
+ * Each watched thread owns a slot where it publishes the message it's processing and when it
+ * started (a few atomic stores per message, no lock). The monitor thread scans the slots and
+ * reports, once per message, the ones busy for longer than their threshold.
+ */
+class CWatchdog {
+public:
+  /*
+   * In flight message of one thread.
+   */
+  struct SSlot {
+    std::atomic<std::uint64_t> nSequence{0};               // Messages started.
+    std::atomic<std::chrono::steady_clock::rep> nStart{0}; // Start of the current one, 0 if idle.
+    std::atomic<int> nMessageID{0};                        // ID of the current one.
+    std::uint64_t nReported = 0;                           // Last sequence reported (monitor).
+
+    /*
+     * A message started processing.
+     */
+    void Begin(int p_nMessageID, std::chrono::steady_clock::time_point dtStart) {
+      nSequence.fetch_add(1, std::memory_order_relaxed);
+      nMessageID.store(p_nMessageID, std::memory_order_release);
+      nStart.store(dtStart.time_since_epoch().count(), std::memory_order_release);
+    }
+
+    /*
+     * The message is done.
+     */
+    void End() { nStart.store(0, std::memory_order_release); }
+  };
+
+  /*
+   * A group of slots sharing a threshold and a stall callback (one per daemon).
+   */
+  struct SProbe {
+    SSlot *pSlots = nullptr;                                  // Slots.
+    size_t nSlots = 0;                                        // How many slots.
+    std::chrono::nanoseconds Threshold{0};                    // Report past this.
+    std::function<void(int, std::chrono::nanoseconds)> Stall; // Callback (message ID, elapsed).
+  };
+
+private:
+  std::vector<SProbe *> m_vProbes;        // Watched probes.
+  std::thread m_Monitor;                  // Monitor thread, created on the first Watch.
+  bool m_bShutdown = false;               // Is the watchdog being destroyed?
+  std::mutex m_Mutex;                     // Protects m_vProbes, held while scanning.
+  std::condition_variable m_ConditionVar; // Wakes the monitor up (new probe or shutdown).
+
+  /*
+   * Time between two scans: a fraction of the smallest threshold, so a stall is reported at most
+   * 25% late. Must be called with m_Mutex held.
+   */
+  std::chrono::nanoseconds ScanPeriod() const {
+    std::chrono::nanoseconds Period = std::chrono::milliseconds(100);
+    for (const SProbe *pProbe : m_vProbes)
+      Period = std::min(Period, pProbe->Threshold / 4);
+    return std::max<std::chrono::nanoseconds>(Period, std::chrono::milliseconds(1));
+  }
+
+  /*
+   * Reports the stalled slots. Must be called with m_Mutex held.
+   */
+  void Scan() {
+    auto nNow = std::chrono::steady_clock::now().time_since_epoch().count();
+    for (SProbe *pProbe : m_vProbes) {
+      for (size_t i = 0; i < pProbe->nSlots; ++i) {
+        SSlot &Slot = pProbe->pSlots[i];
+        std::uint64_t nSequence = Slot.nSequence.load(std::memory_order_acquire);
+        auto nStart = Slot.nStart.load(std::memory_order_acquire);
+        int nMessageID = Slot.nMessageID.load(std::memory_order_acquire);
+        if (nStart == 0 || nSequence == Slot.nReported ||
+            nSequence != Slot.nSequence.load(std::memory_order_acquire))
+          continue; // Idle, already reported or it just moved on
+
+        std::chrono::nanoseconds Elapsed{std::chrono::steady_clock::duration(nNow - nStart)};
+        if (Elapsed >= pProbe->Threshold) {
+          Slot.nReported = nSequence;
+          pProbe->Stall(nMessageID, Elapsed);
+        }
+      }
+    }
+  }
+
+  /*
+   * Monitor thread loop.
+   */
+  void Monitor() {
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (!m_bShutdown) {
+      m_ConditionVar.wait_for(lock, ScanPeriod());
+      Scan();
+    }
+  }
+
+public:
+  CWatchdog() = default;
+  CWatchdog(const CWatchdog &) = delete;
+  CWatchdog &operator=(const CWatchdog &) = delete;
+
+  /*
+   * Destructor, stops the monitor thread.
+   */
+  ~CWatchdog() {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      m_bShutdown = true;
+    }
+    m_ConditionVar.notify_all();
+    if (m_Monitor.joinable())
+      m_Monitor.join();
+  }
+
+  /*
+   * Process wide watchdog, used by the daemons.
+   */
+  static CWatchdog &Shared() {
+    static CWatchdog sWatchdog;
+    return sWatchdog;
+  }
+
+  /*
+   * Starts watching a probe, it must stay alive until Unwatch.
+   */
+  void Watch(SProbe *pProbe) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      m_vProbes.push_back(pProbe);
+      if (!m_Monitor.joinable())
+        m_Monitor = std::thread(&CWatchdog::Monitor, this);
+    }
+    m_ConditionVar.notify_all(); // The scan period may be shorter now
+  }
+
+  /*
+   * Stops watching a probe.
+   * When it returns, no stall callback of this probe is running or will run.
+   */
+  void Unwatch(SProbe *pProbe) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    m_vProbes.erase(std::remove(m_vProbes.begin(), m_vProbes.end(), pProbe), m_vProbes.end());
+  }
+};
+
+#endif // WATCHDOG_NS_H
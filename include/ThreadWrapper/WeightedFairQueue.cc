@@ -0,0 +1,173 @@
+#ifndef WEIGHTED_FAIR_QUEUE_NS_H
+#define WEIGHTED_FAIR_QUEUE_NS_H
+#ifdef WEIGHTED_FAIR_QUEUE_NS_H
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#endif
+
+/*
+ * Weighted fair queue engine across message IDs for CDaemon (see HeapQueue.cc for the engine
+ * interface).
+ * Each message ID (TData::nMessageID) has its own sub-queue, ordered by priority, and the
+ * sub-queues share the daemon time with start-time fair queuing: a sub-queue is tagged with a
+ * virtual start time, the smallest tag is served and its tag then advances by the message cost
+ * divided by the ID share. The cost is the measured service time of that ID (an exponentially
+ * decayed average fed by CDaemon through OnServiced), so an expensive message type gets its share
+ * of the daemon time, not its share of the messages.
+ * Usage: CDaemon<T, CWeightedFairQueue>, shares set with GetQueue().SetShare(nMessageID, fShare).
+ */
+template <class TData, class TCompare> class CWeightedFairQueue {
+private:
+  /*
+   * Message ID sub-queue.
+   */
+  struct SFlow {
+    std::vector<TData> vHeap; // Messages, by priority.
+    double fShare = 1.0;      // Weight.
+    double fCostSec = 0.0;    // Service time estimate (s), 0 until the first measurement.
+    double fFinish = 0.0;     // Virtual finish tag of the last message served.
+    double fStart = 0.0;      // Virtual start tag while backlogged.
+  };
+
+  static constexpr double kDecay = 0.125;      // Weight of a new service time sample.
+  static constexpr double kDefaultCost = 1e-6; // Cost before the first measurement (s).
+
+  std::unordered_map<int, SFlow> m_Flows;        // Sub-queues by message ID.
+  std::set<std::pair<double, int>> m_Backlogged; // (start tag, message ID) of non empty ones.
+  double m_fVirtualTime = 0.0;                   // Start tag of the last message served.
+  TCompare m_Compare;                            // Ordering inside a sub-queue.
+  std::atomic<size_t> m_nSize = 0;               // Queued objects.
+  mutable std::mutex m_Mutex;                    // Mutex.
+
+  /*
+   * Adds one object to its sub-queue.
+   * Must be called with m_Mutex held.
+   */
+  void PushLocked(TData &&Data) {
+    int nMessageID = Data.nMessageID;
+    SFlow &Flow = m_Flows[nMessageID];
+    if (Flow.vHeap.empty()) {
+      Flow.fStart = std::max(m_fVirtualTime, Flow.fFinish);
+      m_Backlogged.emplace(Flow.fStart, nMessageID);
+    }
+    Flow.vHeap.push_back(std::move(Data));
+    std::push_heap(Flow.vHeap.begin(), Flow.vHeap.end(), m_Compare);
+  }
+
+  /*
+   * Serves the sub-queue with the smallest start tag.
+   * Must be called with m_Mutex held.
+   */
+  bool PopLocked(TData &Data) {
+    if (m_Backlogged.empty())
+      return false;
+
+    auto [fStart, nMessageID] = *m_Backlogged.begin();
+    m_Backlogged.erase(m_Backlogged.begin());
+    SFlow &Flow = m_Flows[nMessageID];
+
+    std::pop_heap(Flow.vHeap.begin(), Flow.vHeap.end(), m_Compare);
+    Data = std::move(Flow.vHeap.back());
+    Flow.vHeap.pop_back();
+
+    m_fVirtualTime = fStart;
+    double fCost = Flow.fCostSec > 0.0 ? Flow.fCostSec : kDefaultCost;
+    Flow.fFinish = fStart + fCost / Flow.fShare;
+    if (!Flow.vHeap.empty()) {
+      Flow.fStart = Flow.fFinish;
+      m_Backlogged.emplace(Flow.fStart, nMessageID);
+    }
+
+    --m_nSize;
+    return true;
+  }
+
+public:
+  /*
+   * Sets the share (weight) of a message ID, the default is 1.
+   * @param nMessageID Message ID.
+   * @param fShare Weight, an ID with twice the share gets twice the daemon time.
+   */
+  void SetShare(int nMessageID, double fShare) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    m_Flows[nMessageID].fShare = fShare > 0.0 ? fShare : 1.0;
+  }
+
+  /*
+   * Measured service time of a message ID, in seconds (0 if it was never served).
+   */
+  double ServiceTime(int nMessageID) const {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    auto it = m_Flows.find(nMessageID);
+    return it != m_Flows.end() ? it->second.fCostSec : 0.0;
+  }
+
+  /*
+   * Service time feedback, CDaemon calls it after each Process.
+   * @param Data The processed object.
+   * @param Elapsed How long it took.
+   */
+  void OnServiced(const TData &Data, std::chrono::nanoseconds Elapsed) {
+    double fSec = std::chrono::duration<double>(Elapsed).count();
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    SFlow &Flow = m_Flows[Data.nMessageID];
+    Flow.fCostSec = Flow.fCostSec > 0.0 ? Flow.fCostSec + kDecay * (fSec - Flow.fCostSec) : fSec;
+  }
+
+  /*
+   * Enqueue one object in its message ID sub-queue.
+   */
+  void Push(TData &&Data) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    PushLocked(std::move(Data));
+    ++m_nSize;
+  }
+
+  /*
+   * Enqueue several objects under a single lock.
+   */
+  void PushBulk(std::vector<TData> &vData) {
+    {
+      std::scoped_lock<std::mutex> lock(m_Mutex);
+      for (TData &Data : vData)
+        PushLocked(std::move(Data));
+      m_nSize += vData.size();
+    }
+    vData.clear();
+  }
+
+  /*
+   * Dequeue the next object, in start tag order.
+   * @return true if there was something to dequeue.
+   */
+  bool TryPop(TData &Data) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    return PopLocked(Data);
+  }
+
+  /*
+   * Dequeue up to nMax objects under a single lock.
+   * @return how many objects were appended to vData.
+   */
+  size_t TryPopBatch(std::vector<TData> &vData, size_t nMax) {
+    std::scoped_lock<std::mutex> lock(m_Mutex);
+    size_t nCount = 0;
+    TData Data;
+    for (; nCount < nMax && PopLocked(Data); ++nCount)
+      vData.push_back(std::move(Data));
+    return nCount;
+  }
+
+  /*
+   * How many objects are queued.
+   */
+  size_t Size() const { return m_nSize.load(); }
+};
+
+#endif // WEIGHTED_FAIR_QUEUE_NS_H